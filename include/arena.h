@@ -0,0 +1,32 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stddef.h>
+
+struct arena;
+
+struct arena*
+arena_new(void);
+
+void
+arena_free(struct arena* arena);
+
+void*
+arena_alloc(struct arena* arena, size_t size);
+
+char*
+arena_strndup(struct arena* arena, const char* str, size_t len);
+
+char*
+arena_strdup(struct arena* arena, const char* str);
+
+void
+arena_reset(struct arena* arena);
+
+struct arena*
+arena_thread(void);
+
+void
+arena_thread_free(void);
+
+#endif
@@ -0,0 +1,23 @@
+#ifndef CERTSTORE_H
+#define CERTSTORE_H
+
+#include "helper.h"
+
+#include <ldns/ldns.h>
+
+int
+certstore_start(char* configfile);
+
+int
+certstore_load_keys(ldns_rr_list* dnskeys);
+
+void
+certstore_stop(void);
+
+int
+certstore_loaded(void);
+
+int
+certstore_get_cert(char* domain, int ksk, struct certrecord* record);
+
+#endif
@@ -0,0 +1,12 @@
+#ifndef CHAINWALK_H
+#define CHAINWALK_H
+
+#include "keyset.h"
+
+#include <ldns/ldns.h>
+
+int
+chainwalk_verify(ldns_resolver* res, ldns_rr_list* rrset, ldns_rr_list* sigs,
+				 struct keyset* trustedkeys);
+
+#endif
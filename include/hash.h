@@ -0,0 +1,15 @@
+#ifndef HASH_H
+#define HASH_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define HASH_SEED 2166136261u
+
+uint32_t
+hash_bytes(const uint8_t* data, size_t len, uint32_t hash);
+
+uint32_t
+hash_dname(const uint8_t* data, size_t len, uint32_t hash);
+
+#endif
@@ -0,0 +1,16 @@
+#ifndef HEDGE_H
+#define HEDGE_H
+
+#include <ldns/ldns.h>
+
+void
+hedge_set_budget(int percent);
+
+int
+hedge_enabled(void);
+
+int
+hedge_query(ldns_pkt** p, ldns_resolver* res, ldns_rdf* domain,
+			ldns_rr_type rtype);
+
+#endif
@@ -1,6 +1,11 @@
 #ifndef HELPER_H
 #define HELPER_H
 
+#include <stddef.h>
+#include <stdint.h>
+
+#define CONFIG_FILE "config.conf"
+
 struct dbconfig
 {
 	char* username;
@@ -8,10 +13,21 @@ struct dbconfig
 	char* dbname;
 };
 
+struct certrecord
+{
+	char* cert;
+	uint8_t* dnskey;
+	size_t dnskey_len;
+};
+
 void
 get_config(char *filename, struct dbconfig* configstruct);
 
 int
-get_mysql_cert(char* configfile, char* domain, char** cert, int ksk);
+get_mysql_cert(char* configfile, char* domain, struct certrecord* record,
+			   int ksk);
+
+void
+close_mysql(void);
 
 #endif
@@ -0,0 +1,26 @@
+#ifndef KEYSET_H
+#define KEYSET_H
+
+#include <ldns/ldns.h>
+
+struct keyset;
+
+struct keyset*
+keyset_new(void);
+
+void
+keyset_free(struct keyset* set);
+
+int
+keyset_add(struct keyset* set, ldns_rr* rr);
+
+size_t
+keyset_count(struct keyset* set);
+
+ldns_rr*
+keyset_find(struct keyset* set, ldns_rr* rr);
+
+ldns_status
+keyset_tree_contains_keys(ldns_dnssec_trust_tree* tree, struct keyset* set);
+
+#endif
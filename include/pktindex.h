@@ -0,0 +1,42 @@
+#ifndef PKTINDEX_H
+#define PKTINDEX_H
+
+#include <ldns/ldns.h>
+
+/*
+ * One RRset of a response packet, with the RRSIGs covering it. The lists
+ * borrow the packet's RRs; they are only valid while the packet is.
+ */
+struct rrgroup {
+	ldns_rdf* owner;
+	ldns_rr_type type;
+	ldns_pkt_section section;
+	ldns_rr_list* rrs;
+	ldns_rr_list* sigs;
+};
+
+struct pktindex {
+	struct rrgroup* groups;
+	size_t count;
+	size_t capacity;
+	size_t* buckets;
+	size_t bucket_count;
+};
+
+int
+pktindex_init(struct pktindex* index, size_t records);
+
+int
+pktindex_add(struct pktindex* index, ldns_rr* rr, ldns_pkt_section section);
+
+int
+pktindex_build(struct pktindex* index, ldns_pkt* pkt);
+
+void
+pktindex_free(struct pktindex* index);
+
+struct rrgroup*
+pktindex_find(struct pktindex* index, ldns_pkt_section section,
+			  ldns_rdf* owner, ldns_rr_type type);
+
+#endif
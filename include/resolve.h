@@ -1,6 +1,12 @@
-#ifdef RESOLVE_H
+#ifndef RESOLVE_H
 #define RESOLVE_H
 
+#include <stdint.h>
+
+#include <ldns/ldns.h>
+
+#include "keyset.h"
+
 int
 create_resolver(ldns_resolver** res, char* serv);
 
@@ -8,24 +14,24 @@ int
 query(ldns_pkt** p, ldns_resolver* res, ldns_rdf* domain, ldns_rr_type rtype);
 
 int
-get_key(char** keystr, char* keynamestr, int ksk);
+get_key(char** keystr, uint8_t* algorithm, char* keynamestr, int ksk);
 
 int
 verify_trust(ldns_dnssec_data_chain** chain, ldns_dnssec_trust_tree** tree,
 			 ldns_resolver* res, ldns_rr_list* rrlist, ldns_pkt* pkt);
 
 int
-check_trustedkeys(ldns_dnssec_trust_tree* tree, ldns_rr_list* trustedkeys);
+check_trustedkeys(ldns_dnssec_trust_tree* tree, struct keyset* trustedkeys);
 
 int
-trustedkey_fromkey(ldns_rr* rr_trustedkey, char* key, char* domain,
-				   int ksk);
+trustedkey_fromkey(ldns_rr** rr_trustedkey, char* key, char* domain,
+				   int ksk, uint8_t algorithm);
 
 int
-addto_trustedkeys(ldns_rr_list* rrset_trustedkeys, ldns_rr* rr_trustedkey);
+addto_trustedkeys(struct keyset* rrset_trustedkeys, ldns_rr* rr_trustedkey);
 
 int
-populate_trustedkeys(ldns_rr_list* rrset_trustedkeys, char* domain);
+populate_trustedkeys(struct keyset* rrset_trustedkeys, char* domain);
 
 int
 verify_rr(ldns_rr_list* rrset, ldns_rr_list* rrsig, char* domain,
@@ -0,0 +1,9 @@
+#ifndef SIGCACHE_H
+#define SIGCACHE_H
+
+#include <ldns/ldns.h>
+
+ldns_status
+sigcache_verify_rrsig(ldns_rr_list* rrset, ldns_rr* rrsig, ldns_rr* key);
+
+#endif
@@ -0,0 +1,45 @@
+#ifndef SINGLEFLIGHT_H
+#define SINGLEFLIGHT_H
+
+#include <stddef.h>
+#include <pthread.h>
+
+#define SINGLEFLIGHT_BUCKETS 64
+
+struct flight;
+
+/*
+ * Concurrent calls with the same key share one execution: the first caller
+ * leads and does the work, later callers wait for its result. copy_value
+ * makes the shared copy of the leader's result, free_value releases it
+ * once the last waiter is done.
+ */
+struct singleflight {
+	pthread_mutex_t lock;
+	void* (*copy_value)(const void* value);
+	void (*free_value)(void* value);
+	struct flight* buckets[SINGLEFLIGHT_BUCKETS];
+};
+
+#define SINGLEFLIGHT_INIT(copy, free) \
+	{ PTHREAD_MUTEX_INITIALIZER, (copy), (free), { NULL } }
+
+struct flight*
+singleflight_join(struct singleflight* group, const void* key, size_t key_len,
+				  int* leader);
+
+void
+singleflight_done(struct singleflight* group, struct flight* flight,
+				  int status, const void* value);
+
+int
+singleflight_wait(struct singleflight* group, struct flight* flight,
+				  const void** value);
+
+void
+singleflight_release(struct singleflight* group, struct flight* flight);
+
+void*
+singleflight_take(struct singleflight* group, struct flight* flight);
+
+#endif
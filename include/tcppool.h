@@ -0,0 +1,16 @@
+#ifndef TCPPOOL_H
+#define TCPPOOL_H
+
+#include <ldns/ldns.h>
+
+int
+tcppool_prefer(ldns_rr_type rtype);
+
+int
+tcppool_query(ldns_pkt** p, ldns_resolver* res, ldns_rdf* domain,
+			  ldns_rr_type rtype);
+
+void
+tcppool_free(void);
+
+#endif
@@ -0,0 +1,18 @@
+#ifndef UPSTREAM_H
+#define UPSTREAM_H
+
+#include <ldns/ldns.h>
+
+ldns_rdf*
+upstream_select(ldns_resolver* res);
+
+void
+upstream_report(ldns_rdf* server, ldns_pkt* pkt);
+
+int
+upstream_rtt_p95(void);
+
+void
+upstream_free(void);
+
+#endif
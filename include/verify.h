@@ -0,0 +1,16 @@
+#ifndef VERIFY_H
+#define VERIFY_H
+
+#include <ldns/ldns.h>
+
+// DNSSEC algorithm numbers; not every ldns build defines all of them
+#define ALG_RSASHA256 8
+#define ALG_ECDSAP256SHA256 13
+#define ALG_ECDSAP384SHA384 14
+#define ALG_ED25519 15
+#define ALG_ED448 16
+
+ldns_status
+verify_rrsig_key(ldns_rr_list* rrset, ldns_rr* rrsig, ldns_rr* key);
+
+#endif
@@ -0,0 +1,23 @@
+#ifndef ZONE_H
+#define ZONE_H
+
+#include <ldns/ldns.h>
+
+struct zone_server;
+
+int
+zone_read(ldns_zone** zone, char* filename, char* includedir);
+
+struct zone_server*
+zone_serve_start(char** files, size_t count, char* keydir);
+
+int
+zone_serve_port(struct zone_server* server);
+
+ldns_rr_list*
+zone_serve_dnskeys(struct zone_server* server);
+
+void
+zone_serve_stop(struct zone_server* server);
+
+#endif
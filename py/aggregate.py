@@ -0,0 +1,60 @@
+#!./venv/bin/python3
+
+import argparse
+import collections
+import json
+
+BINS_SUFFIX = ".bins.json"
+
+def aggregate(filename):
+    """Stream reqsize output once and count responses per algorithm and size"""
+    bins = collections.defaultdict(collections.Counter)
+    with open(filename) as f:
+        for line in f:
+            parts = line.split()
+            # Header lines and failed requests don't carry numeric columns
+            if len(parts) < 3 or not parts[1].isdigit() or not parts[2].isdigit():
+                continue
+            bins[int(parts[2])][int(parts[1])] += 1
+    return bins
+
+def save_bins(bins, filename):
+    with open(filename, "w") as f:
+        json.dump({str(alg): {str(size): count for size, count in sizes.items()}
+                   for alg, sizes in bins.items()}, f)
+
+def load_bins(filename):
+    with open(filename) as f:
+        data = json.load(f)
+    bins = collections.defaultdict(collections.Counter)
+    for alg, sizes in data.items():
+        for size, count in sizes.items():
+            bins[int(alg)][int(size)] = count
+    return bins
+
+def read_bins(filename):
+    """Read pre-aggregated bins, or aggregate a raw reqsize output file"""
+    if filename.endswith(BINS_SUFFIX):
+        return load_bins(filename)
+    return aggregate(filename)
+
+def main():
+    parser = argparse.ArgumentParser(description="Aggregate DNSSEC response sizes into per algorithm bins")
+    parser.add_argument("--filename", metavar="F", type=str, nargs=1,
+                        required=True, help="File generated by reqsize")
+    parser.add_argument("--output", metavar="O", type=str, nargs=1,
+                        help="Bins file to write, defaults to F" + BINS_SUFFIX)
+    args = parser.parse_args()
+
+    if args.output:
+        output = args.output[0]
+    else:
+        output = args.filename[0] + BINS_SUFFIX
+
+    bins = aggregate(args.filename[0])
+    save_bins(bins, output)
+    for alg in sorted(bins):
+        print("Algorithm %d: %d responses" % (alg, sum(bins[alg].values())))
+
+if __name__ == "__main__":
+    main()
@@ -3,34 +3,33 @@
 import argparse
 import plotly
 
-def create_bar(data, alg_name):
+from aggregate import read_bins
+
+def create_bar(sizes, counts, alg_name):
     return dict(
         type = "bar",
         name = alg_name,
-        x = data,
-        y = data,
-        transforms = [dict(
-            type = "aggregate",
-            groups = data,
-            aggregations = [dict(
-                target = "y", func = "count", enabled = True)
-            ]
-        )]
+        x = sizes,
+        y = counts
     )
 
-def create_hist(data, alg_name):
+def create_hist(sizes, counts, alg_name):
     return dict(
         type = "histogram",
         name = alg_name,
-        x = data,
+        x = sizes,
+        y = counts,
+        histfunc = "sum",
         histnorm = "percent"
     )
 
-def create_cumm(data, alg_name):
+def create_cumm(sizes, counts, alg_name):
     return dict(
         type = "histogram",
         name = alg_name,
-        x = data,
+        x = sizes,
+        y = counts,
+        histfunc = "sum",
         histnorm = "percent",
         cumulative=dict(enabled=True),
         opacity=0.75
@@ -60,19 +59,19 @@ def graph(traces, title, r=None):
         validate=False
     )
 
-def process_file(filename, alg):
+def process_file(filename, algs):
+    """Size bins per algorithm, in the order requested"""
+    bins = read_bins(filename)
     rrsize = []
-    with open(filename) as f:
-        for line in f.readlines()[3:]:
-            parts = line.split()
-            if len(parts) is 3 and int(parts[2]) == alg:
-                rrsize.append(int(parts[1]))
+    for a in algs:
+        sizes = sorted(bins[a])
+        rrsize.append((sizes, [bins[a][s] for s in sizes]))
     return rrsize
 
 def main():
     parser = argparse.ArgumentParser(description="Create graphs from DNSSEC response sizes")
     parser.add_argument("--filename", metavar="F", type=str, nargs=1,
-                        required=True, help="File to read values from")
+                        required=True, help="File to read values from, either reqsize output or bins from aggregate.py")
     parser.add_argument("--title", metavar="T", type=str, nargs=1, default="",
                         help="Graph Title")
     parser.add_argument("--algorithms", metavar="A", type=int, nargs="+",
@@ -91,19 +90,18 @@ def main():
         title = args.title
 
     algs = args.algorithms
-    rrsize = []
-    for a in algs:
-        rrsize.append(process_file(args.filename[0], a))
+    rrsize = process_file(args.filename[0], algs)
 
     traces = []
     chart = args.chart[0]
     for i in range(len(rrsize)):
+        sizes, counts = rrsize[i]
         if chart == "bar":
-            traces.append(create_bar(rrsize[i], algs[i]))
+            traces.append(create_bar(sizes, counts, algs[i]))
         elif chart == "hist":
-            traces.append(create_hist(rrsize[i], algs[i]))
+            traces.append(create_hist(sizes, counts, algs[i]))
         elif chart == "cumm":
-            traces.append(create_cumm(rrsize[i], algs[i]))
+            traces.append(create_cumm(sizes, counts, algs[i]))
 
     rang = None
     if args.rang:
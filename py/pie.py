@@ -3,6 +3,8 @@
 import argparse
 import plotly
 
+from aggregate import read_bins
+
 def create_pie(data):
     names = []
     amount = []
@@ -30,22 +32,16 @@ def graph(traces, title):
     )
 
 def process_file(filename):
+    bins = read_bins(filename)
     algorithms = {}
-    with open(filename) as f:
-        for line in f.readlines()[3:]:
-            parts = line.split()
-            if len(parts) is 3:
-                alg = parts[2]
-                if alg not in algorithms:
-                    algorithms[alg] = 1
-                else:
-                    algorithms[alg] += 1
+    for alg in sorted(bins):
+        algorithms[str(alg)] = sum(bins[alg].values())
     return algorithms
 
 def main():
     parser = argparse.ArgumentParser(description="Create graphs from DNSSEC response sizes")
     parser.add_argument("--filename", metavar="F", type=str, nargs=1,
-                        required=True, help="File to read values from")
+                        required=True, help="File to read values from, either reqsize output or bins from aggregate.py")
     parser.add_argument("--title", metavar="T", type=str, nargs=1, default="",
                         help="Graph Title")
     args = parser.parse_args()
@@ -0,0 +1,142 @@
+#include "arena.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#define ARENA_CHUNK 4096
+#define ARENA_ALIGN 16
+
+/*
+ * Bump allocator for buffers that only live for one query. Nothing is freed
+ * individually; arena_reset() drops everything at once and keeps the first
+ * chunk around for the next query.
+ */
+struct arena_chunk {
+	struct arena_chunk* next;
+	size_t size;
+	size_t used;
+	char data[];
+};
+
+struct arena {
+	struct arena_chunk* head;
+};
+
+static pthread_key_t thread_key;
+static pthread_once_t thread_once = PTHREAD_ONCE_INIT;
+
+static struct arena_chunk*
+chunk_new(size_t size) {
+	struct arena_chunk* chunk = malloc(sizeof(struct arena_chunk) + size);
+	if (!chunk)
+		return NULL;
+	chunk->next = NULL;
+	chunk->size = size;
+	chunk->used = 0;
+	return chunk;
+}
+
+struct arena*
+arena_new(void) {
+	struct arena* arena = malloc(sizeof(struct arena));
+	if (!arena)
+		return NULL;
+	arena->head = chunk_new(ARENA_CHUNK);
+	if (!arena->head) {
+		free(arena);
+		return NULL;
+	}
+	return arena;
+}
+
+void
+arena_free(struct arena* arena) {
+	if (!arena)
+		return;
+	struct arena_chunk* chunk = arena->head;
+	while (chunk) {
+		struct arena_chunk* next = chunk->next;
+		free(chunk);
+		chunk = next;
+	}
+	free(arena);
+}
+
+// A NULL arena, e.g. from a failed arena_thread(), allocates nothing
+void*
+arena_alloc(struct arena* arena, size_t size) {
+	if (!arena)
+		return NULL;
+	size = (size + ARENA_ALIGN - 1) & ~((size_t) ARENA_ALIGN - 1);
+	struct arena_chunk* chunk = arena->head;
+	if (chunk->size - chunk->used < size) {
+		chunk = chunk_new(size > ARENA_CHUNK ? size : ARENA_CHUNK);
+		if (!chunk)
+			return NULL;
+		chunk->next = arena->head;
+		arena->head = chunk;
+	}
+	void* p = chunk->data + chunk->used;
+	chunk->used += size;
+	return p;
+}
+
+char*
+arena_strndup(struct arena* arena, const char* str, size_t len) {
+	char* p = arena_alloc(arena, len + 1);
+	if (!p)
+		return NULL;
+	memcpy(p, str, len);
+	p[len] = '\0';
+	return p;
+}
+
+char*
+arena_strdup(struct arena* arena, const char* str) {
+	return arena_strndup(arena, str, strlen(str));
+}
+
+void
+arena_reset(struct arena* arena) {
+	if (!arena)
+		return;
+	// Keep only the oldest chunk, which sits at the end of the list
+	struct arena_chunk* chunk = arena->head;
+	while (chunk->next) {
+		struct arena_chunk* next = chunk->next;
+		free(chunk);
+		chunk = next;
+	}
+	chunk->used = 0;
+	arena->head = chunk;
+}
+
+static void
+thread_destroy(void* arena) {
+	arena_free(arena);
+}
+
+static void
+thread_init(void) {
+	pthread_key_create(&thread_key, thread_destroy);
+}
+
+// Per-thread arena, so workers never contend on the allocator
+struct arena*
+arena_thread(void) {
+	pthread_once(&thread_once, thread_init);
+	struct arena* arena = pthread_getspecific(thread_key);
+	if (!arena) {
+		arena = arena_new();
+		pthread_setspecific(thread_key, arena);
+	}
+	return arena;
+}
+
+void
+arena_thread_free(void) {
+	pthread_once(&thread_once, thread_init);
+	arena_free(pthread_getspecific(thread_key));
+	pthread_setspecific(thread_key, NULL);
+}
@@ -0,0 +1,624 @@
+#include "certstore.h"
+#include "arena.h"
+#include "hash.h"
+#include "helper.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#include <mysql/mysql.h>
+#include <mysql/mysqld_error.h>
+
+#include <ldns/ldns.h>
+
+#define CERTSTORE_BUCKETS 1024
+#define CERTSTORE_REFRESH 2
+#define CERTSTORE_TICK_US 100000
+#define CERTSTORE_OVERLAP 5
+#define CERTSTORE_STAMP 32
+#define MAXQUERY 256
+
+extern int verbosity;
+
+/*
+ * In-memory copy of the certificates table. Readers look keys up in the
+ * currently published snapshot without taking a lock. The refresh thread
+ * reads only the rows changed since its last poll and publishes a new
+ * snapshot that shares every untouched bucket with the old one; the old
+ * snapshot is freed once every reader that could still see it has
+ * finished.
+ *
+ * Buckets and entries are reference counted across snapshots. Only the
+ * thread publishing snapshots touches the counts.
+ */
+struct cert_entry {
+	char* domain;
+	char* cert;
+	uint8_t* dnskey;
+	size_t dnskey_len;
+	int ksk;
+	uint32_t hash;
+	int refs;
+};
+
+struct cert_bucket {
+	int refs;
+	size_t count;
+	struct cert_entry* entries[];
+};
+
+struct cert_snapshot {
+	struct cert_bucket* buckets[CERTSTORE_BUCKETS];
+	size_t count;
+};
+
+static _Atomic(struct cert_snapshot*) current = NULL;
+static atomic_uint epoch = 0;
+static atomic_int readers[2];
+
+static atomic_int running = 0;
+static pthread_t refresh_thread;
+static char* store_configfile;
+// Database time the next poll reads changes from
+static char feed_since[CERTSTORE_STAMP];
+
+static uint32_t
+entry_hash(const char* domain, int ksk) {
+	uint8_t k = ksk ? 1 : 0;
+	uint32_t hash = hash_dname((const uint8_t*) domain, strlen(domain),
+							   HASH_SEED);
+	return hash_bytes(&k, 1, hash);
+}
+
+static struct cert_entry*
+entry_new(const char* domain, int ksk, const char* cert, const uint8_t* dnskey,
+		  size_t dnskey_len) {
+	struct cert_entry* entry = calloc(1, sizeof(struct cert_entry));
+	if (!entry)
+		return NULL;
+	entry->domain = strdup(domain);
+	entry->ksk = ksk ? 1 : 0;
+	entry->cert = cert ? strdup(cert) : NULL;
+	if (dnskey && dnskey_len > 0) {
+		entry->dnskey = malloc(dnskey_len);
+		if (entry->dnskey) {
+			memcpy(entry->dnskey, dnskey, dnskey_len);
+			entry->dnskey_len = dnskey_len;
+		}
+	}
+	if (!entry->domain) {
+		free(entry->cert);
+		free(entry->dnskey);
+		free(entry);
+		return NULL;
+	}
+	entry->hash = entry_hash(entry->domain, entry->ksk);
+	return entry;
+}
+
+static void
+entry_release(struct cert_entry* entry) {
+	if (!entry || --entry->refs > 0)
+		return;
+	free(entry->domain);
+	free(entry->cert);
+	free(entry->dnskey);
+	free(entry);
+}
+
+static int
+entry_matches(struct cert_entry* entry, uint32_t hash, const char* domain,
+			  int ksk) {
+	return entry->hash == hash && entry->ksk == (ksk ? 1 : 0) &&
+		strcasecmp(entry->domain, domain) == 0;
+}
+
+static int
+entry_same(struct cert_entry* a, struct cert_entry* b) {
+	if ((a->cert == NULL) != (b->cert == NULL) ||
+		(a->cert && strcmp(a->cert, b->cert) != 0))
+		return 0;
+	return a->dnskey_len == b->dnskey_len &&
+		(a->dnskey_len == 0 || memcmp(a->dnskey, b->dnskey, a->dnskey_len) == 0);
+}
+
+static void
+bucket_release(struct cert_bucket* bucket) {
+	if (!bucket || --bucket->refs > 0)
+		return;
+	for (size_t i = 0; i < bucket->count; i++)
+		entry_release(bucket->entries[i]);
+	free(bucket);
+}
+
+static void
+snapshot_free(struct cert_snapshot* snap) {
+	if (!snap)
+		return;
+	for (int i = 0; i < CERTSTORE_BUCKETS; i++)
+		bucket_release(snap->buckets[i]);
+	free(snap);
+}
+
+static struct cert_entry*
+snapshot_find(struct cert_snapshot* snap, uint32_t hash, const char* domain,
+			  int ksk) {
+	struct cert_bucket* bucket = snap->buckets[hash % CERTSTORE_BUCKETS];
+	for (size_t i = 0; bucket && i < bucket->count; i++) {
+		if (entry_matches(bucket->entries[i], hash, domain, ksk))
+			return bucket->entries[i];
+	}
+	return NULL;
+}
+
+// Snapshot holding the given entries, for a full load
+static struct cert_snapshot*
+snapshot_build(struct cert_entry** entries, size_t count) {
+	struct cert_snapshot* snap = calloc(1, sizeof(struct cert_snapshot));
+	size_t* sizes = calloc(CERTSTORE_BUCKETS, sizeof(size_t));
+	int failed = !snap || !sizes;
+	for (size_t i = 0; !failed && i < count; i++)
+		sizes[entries[i]->hash % CERTSTORE_BUCKETS]++;
+	for (int b = 0; !failed && b < CERTSTORE_BUCKETS; b++) {
+		if (sizes[b] == 0)
+			continue;
+		snap->buckets[b] = malloc(sizeof(struct cert_bucket) +
+								  sizes[b] * sizeof(struct cert_entry*));
+		if (!snap->buckets[b]) {
+			failed = 1;
+			break;
+		}
+		snap->buckets[b]->refs = 1;
+		snap->buckets[b]->count = 0;
+	}
+	free(sizes);
+	if (failed) {
+		snapshot_free(snap);
+		for (size_t i = 0; i < count; i++)
+			entry_release(entries[i]);
+		return NULL;
+	}
+
+	for (size_t i = 0; i < count; i++) {
+		struct cert_bucket* bucket =
+			snap->buckets[entries[i]->hash % CERTSTORE_BUCKETS];
+		entries[i]->refs = 1;
+		bucket->entries[bucket->count++] = entries[i];
+	}
+	snap->count = count;
+	return snap;
+}
+
+// New snapshot sharing every bucket of snap
+static struct cert_snapshot*
+snapshot_copy(struct cert_snapshot* snap) {
+	struct cert_snapshot* copy = calloc(1, sizeof(struct cert_snapshot));
+	if (!copy || !snap)
+		return copy;
+	for (int b = 0; b < CERTSTORE_BUCKETS; b++) {
+		copy->buckets[b] = snap->buckets[b];
+		if (copy->buckets[b])
+			copy->buckets[b]->refs++;
+	}
+	copy->count = snap->count;
+	return copy;
+}
+
+/*
+ * Replace the entry for (domain, ksk) in a snapshot that is not published
+ * yet, or remove it when entry is NULL. Only the affected bucket is copied.
+ */
+static int
+snapshot_set(struct cert_snapshot* snap, const char* domain, int ksk,
+			 struct cert_entry* entry) {
+	uint32_t hash = entry_hash(domain, ksk);
+	int b = hash % CERTSTORE_BUCKETS;
+	struct cert_bucket* old = snap->buckets[b];
+	size_t old_count = old ? old->count : 0;
+	struct cert_bucket* bucket = malloc(sizeof(struct cert_bucket) +
+										(old_count + 1) *
+										sizeof(struct cert_entry*));
+	if (!bucket)
+		return LDNS_STATUS_MEM_ERR;
+	bucket->refs = 1;
+	bucket->count = 0;
+	for (size_t i = 0; i < old_count; i++) {
+		if (entry_matches(old->entries[i], hash, domain, ksk))
+			continue;
+		old->entries[i]->refs++;
+		bucket->entries[bucket->count++] = old->entries[i];
+	}
+	if (entry) {
+		entry->refs++;
+		bucket->entries[bucket->count++] = entry;
+	}
+	snap->count += bucket->count;
+	snap->count -= old_count;
+	snap->buckets[b] = bucket;
+	bucket_release(old);
+	return LDNS_STATUS_OK;
+}
+
+static unsigned int
+read_lock(void) {
+	for (;;) {
+		unsigned int e = atomic_load(&epoch);
+		atomic_fetch_add(&readers[e & 1], 1);
+		if (atomic_load(&epoch) == e)
+			return e;
+		atomic_fetch_sub(&readers[e & 1], 1);
+	}
+}
+
+static void
+read_unlock(unsigned int e) {
+	atomic_fetch_sub(&readers[e & 1], 1);
+}
+
+// Wait until no reader can still hold the previously published snapshot
+static void
+synchronize(void) {
+	unsigned int e = atomic_fetch_add(&epoch, 1);
+	while (atomic_load(&readers[e & 1]) > 0)
+		usleep(100);
+}
+
+static void
+publish(struct cert_snapshot* snap) {
+	struct cert_snapshot* old = atomic_exchange(&current, snap);
+	synchronize();
+	snapshot_free(old);
+}
+
+static MYSQL*
+db_connect(char* configfile) {
+	MYSQL* con = mysql_init(NULL);
+	if (con == NULL) {
+		fprintf(stderr, "mysql_init() failed\n");
+		return NULL;
+	}
+
+	struct dbconfig config;
+	get_config(configfile, &config);
+	if (mysql_real_connect(con, "localhost", config.username, config.password,
+						   config.dbname, 0, NULL, 0) == NULL) {
+		fprintf(stderr, "%s\n", mysql_error(con));
+		mysql_close(con);
+		return NULL;
+	}
+	return con;
+}
+
+// Database time to read changes from next, a little early to catch rows
+// from transactions that were still open while the table was read
+static int
+db_stamp(MYSQL* con, char* stamp) {
+	char query[MAXQUERY];
+	snprintf(query, sizeof(query), "SELECT NOW(6) - INTERVAL %d SECOND",
+			 CERTSTORE_OVERLAP);
+	if (mysql_query(con, query)) {
+		if (verbosity >= 4)
+			fprintf(stderr, "%s\n", mysql_error(con));
+		return LDNS_STATUS_ERR;
+	}
+	MYSQL_RES* mysql_result = mysql_store_result(con);
+	if (mysql_result == NULL)
+		return LDNS_STATUS_ERR;
+
+	int result = LDNS_STATUS_ERR;
+	MYSQL_ROW row = mysql_fetch_row(mysql_result);
+	if (row && row[0] && strlen(row[0]) < CERTSTORE_STAMP) {
+		strcpy(stamp, row[0]);
+		result = LDNS_STATUS_OK;
+	}
+	mysql_free_result(mysql_result);
+	return result;
+}
+
+static struct cert_snapshot*
+load_snapshot(MYSQL* con) {
+	// Tables that have not been migrated yet have no dnskey column
+	if (mysql_query(con, "SELECT domain, ksk, cert, dnskey FROM certificates") &&
+		mysql_query(con, "SELECT domain, ksk, cert, NULL FROM certificates")) {
+		fprintf(stderr, "%s\n", mysql_error(con));
+		return NULL;
+	}
+	MYSQL_RES* mysql_result = mysql_use_result(con);
+	if (mysql_result == NULL) {
+		fprintf(stderr, "%s\n", mysql_error(con));
+		return NULL;
+	}
+
+	size_t count = 0;
+	size_t capacity = 1024;
+	struct cert_entry** entries = malloc(capacity * sizeof(struct cert_entry*));
+	MYSQL_ROW row;
+	while (entries && (row = mysql_fetch_row(mysql_result)) != NULL) {
+		if (row[0] == NULL || row[1] == NULL)
+			continue;
+		if (count == capacity) {
+			capacity *= 2;
+			struct cert_entry** grown =
+				realloc(entries, capacity * sizeof(struct cert_entry*));
+			if (!grown)
+				break;
+			entries = grown;
+		}
+		unsigned long* lengths = mysql_fetch_lengths(mysql_result);
+		struct cert_entry* entry =
+			entry_new(row[0], atoi(row[1]), row[2], (uint8_t*) row[3],
+					  row[3] ? lengths[3] : 0);
+		if (!entry)
+			break;
+		entries[count++] = entry;
+	}
+	mysql_free_result(mysql_result);
+	if (!entries)
+		return NULL;
+
+	struct cert_snapshot* snap = snapshot_build(entries, count);
+	free(entries);
+	return snap;
+}
+
+/*
+ * Apply the rows changed since feed_since to a copy of snap. *next stays
+ * NULL when nothing actually changed. Deletions are applied first: the
+ * changed rows come from the table's current state, so a key that was
+ * deleted and added again ends up present.
+ */
+static int
+load_changes(MYSQL* con, struct cert_snapshot* snap,
+			 struct cert_snapshot** next) {
+	char query[MAXQUERY];
+	*next = NULL;
+	snprintf(query, sizeof(query),
+			 "SELECT domain, ksk FROM certificate_deletions "
+			 "WHERE deleted_at >= '%s'", feed_since);
+	if (mysql_query(con, query)) {
+		unsigned int err = mysql_errno(con);
+		if (err == ER_NO_SUCH_TABLE || err == ER_BAD_FIELD_ERROR)
+			return LDNS_STATUS_NOT_IMPL;
+		return LDNS_STATUS_ERR;
+	}
+	MYSQL_RES* mysql_result = mysql_store_result(con);
+	if (mysql_result == NULL)
+		return LDNS_STATUS_ERR;
+
+	int result = LDNS_STATUS_OK;
+	struct cert_snapshot* copy = NULL;
+	MYSQL_ROW row;
+	while (result == LDNS_STATUS_OK &&
+		   (row = mysql_fetch_row(mysql_result)) != NULL) {
+		if (row[0] == NULL || row[1] == NULL)
+			continue;
+		int ksk = atoi(row[1]) != 0;
+		if (!snapshot_find(copy ? copy : snap, entry_hash(row[0], ksk), row[0],
+						   ksk))
+			continue;
+		if (!copy && !(copy = snapshot_copy(snap)))
+			result = LDNS_STATUS_MEM_ERR;
+		else
+			result = snapshot_set(copy, row[0], ksk, NULL);
+	}
+	mysql_free_result(mysql_result);
+
+	snprintf(query, sizeof(query),
+			 "SELECT domain, ksk, cert, dnskey FROM certificates "
+			 "WHERE updated_at >= '%s'", feed_since);
+	if (result == LDNS_STATUS_OK && mysql_query(con, query)) {
+		unsigned int err = mysql_errno(con);
+		result = err == ER_BAD_FIELD_ERROR ?
+			LDNS_STATUS_NOT_IMPL : LDNS_STATUS_ERR;
+	}
+	mysql_result = result == LDNS_STATUS_OK ? mysql_use_result(con) : NULL;
+	if (result == LDNS_STATUS_OK && mysql_result == NULL)
+		result = LDNS_STATUS_ERR;
+	while (result == LDNS_STATUS_OK &&
+		   (row = mysql_fetch_row(mysql_result)) != NULL) {
+		if (row[0] == NULL || row[1] == NULL)
+			continue;
+		unsigned long* lengths = mysql_fetch_lengths(mysql_result);
+		struct cert_entry* entry =
+			entry_new(row[0], atoi(row[1]), row[2], (uint8_t*) row[3],
+					  row[3] ? lengths[3] : 0);
+		if (!entry) {
+			result = LDNS_STATUS_MEM_ERR;
+			break;
+		}
+		// Rows inside the overlap are seen again on the next poll
+		struct cert_entry* known = snapshot_find(copy ? copy : snap,
+												 entry->hash, entry->domain,
+												 entry->ksk);
+		if (known && entry_same(known, entry)) {
+			entry_release(entry);
+			continue;
+		}
+		if (!copy && !(copy = snapshot_copy(snap)))
+			result = LDNS_STATUS_MEM_ERR;
+		else
+			result = snapshot_set(copy, entry->domain, entry->ksk, entry);
+		if (entry->refs == 0)
+			entry_release(entry);
+	}
+	if (mysql_result)
+		mysql_free_result(mysql_result);
+
+	if (result != LDNS_STATUS_OK) {
+		snapshot_free(copy);
+		return result;
+	}
+	*next = copy;
+	return LDNS_STATUS_OK;
+}
+
+static void*
+refresh(void* arg) {
+	mysql_thread_init();
+	MYSQL* con = NULL;
+	int ticks = 0;
+	while (atomic_load(&running)) {
+		usleep(CERTSTORE_TICK_US);
+		if (++ticks < CERTSTORE_REFRESH * (1000000 / CERTSTORE_TICK_US))
+			continue;
+		ticks = 0;
+
+		if (!con && !(con = db_connect(store_configfile)))
+			continue;
+
+		// Only this thread publishes, so reading current here is safe
+		char stamp[CERTSTORE_STAMP];
+		struct cert_snapshot* next = NULL;
+		int result = db_stamp(con, stamp);
+		if (result == LDNS_STATUS_OK)
+			result = load_changes(con, atomic_load(&current), &next);
+		if (result == LDNS_STATUS_NOT_IMPL) {
+			fprintf(stderr, "The certificates table has no change feed; run "
+					"util/migrate.sql to keep preloaded keys refreshed\n");
+			break;
+		} else if (result != LDNS_STATUS_OK) {
+			// Connection may have dropped; reconnect on the next poll
+			mysql_close(con);
+			con = NULL;
+			continue;
+		}
+
+		strcpy(feed_since, stamp);
+		if (next) {
+			publish(next);
+			if (verbosity >= 2)
+				fprintf(stderr, "Applied certificate changes, %zu certificates\n",
+						next->count);
+		}
+	}
+	if (con)
+		mysql_close(con);
+	mysql_thread_end();
+	return NULL;
+}
+
+int
+certstore_start(char* configfile) {
+	MYSQL* con = db_connect(configfile);
+	if (!con)
+		return LDNS_STATUS_ERR;
+
+	// Taken before the load, so changes made during it are read again
+	int stamped = db_stamp(con, feed_since) == LDNS_STATUS_OK;
+	struct cert_snapshot* snap = load_snapshot(con);
+	mysql_close(con);
+	if (!snap)
+		return LDNS_STATUS_ERR;
+	if (verbosity >= 2)
+		fprintf(stderr, "Preloaded %zu certificates\n", snap->count);
+	publish(snap);
+	if (!stamped)
+		return LDNS_STATUS_OK;
+
+	store_configfile = configfile;
+	atomic_store(&running, 1);
+	if (pthread_create(&refresh_thread, NULL, refresh, NULL) != 0) {
+		atomic_store(&running, 0);
+		fprintf(stderr, "Couldn't start certificate refresh thread\n");
+	}
+	return LDNS_STATUS_OK;
+}
+
+void
+certstore_stop(void) {
+	if (atomic_exchange(&running, 0))
+		pthread_join(refresh_thread, NULL);
+	publish(NULL);
+}
+
+// Serve the given DNSKEYs instead of the database, e.g. for offline tests
+int
+certstore_load_keys(ldns_rr_list* dnskeys) {
+	size_t count = 0;
+	struct cert_entry** entries =
+		malloc((ldns_rr_list_rr_count(dnskeys) + 1) * sizeof(struct cert_entry*));
+	if (!entries)
+		return LDNS_STATUS_MEM_ERR;
+
+	for (size_t i = 0; i < ldns_rr_list_rr_count(dnskeys); i++) {
+		ldns_rr* rr = ldns_rr_list_rr(dnskeys, i);
+		if (ldns_rr_get_type(rr) != LDNS_RR_TYPE_DNSKEY ||
+			ldns_rr_rd_count(rr) < 4)
+			continue;
+		ldns_rdf* key = ldns_rr_rdf(rr, 3);
+		char* domain = ldns_rdf2str(ldns_rr_owner(rr));
+		size_t dnskey_len = ldns_rdf_size(key) + 1;
+		uint8_t* dnskey = malloc(dnskey_len);
+		if (!domain || !dnskey) {
+			free(domain);
+			free(dnskey);
+			break;
+		}
+		dnskey[0] = ldns_rdf2native_int8(ldns_rr_rdf(rr, 2));
+		memcpy(dnskey + 1, ldns_rdf_data(key), ldns_rdf_size(key));
+		int ksk = (ldns_rdf2native_int16(ldns_rr_rdf(rr, 0)) &
+				   LDNS_KEY_SEP_KEY) != 0;
+		struct cert_entry* entry = entry_new(domain, ksk, NULL, dnskey,
+											 dnskey_len);
+		free(domain);
+		free(dnskey);
+		if (!entry)
+			break;
+		entries[count++] = entry;
+	}
+
+	struct cert_snapshot* snap = snapshot_build(entries, count);
+	free(entries);
+	if (!snap)
+		return LDNS_STATUS_MEM_ERR;
+	if (verbosity >= 2)
+		fprintf(stderr, "Loaded %zu keys\n", snap->count);
+	publish(snap);
+	return LDNS_STATUS_OK;
+}
+
+int
+certstore_loaded(void) {
+	return atomic_load(&current) != NULL;
+}
+
+int
+certstore_get_cert(char* domain, int ksk, struct certrecord* record) {
+	int result = LDNS_STATUS_ERR;
+	record->cert = NULL;
+	record->dnskey = NULL;
+	record->dnskey_len = 0;
+	uint32_t hash = entry_hash(domain, ksk);
+
+	unsigned int e = read_lock();
+	struct cert_snapshot* snap = atomic_load(&current);
+	struct cert_entry* entry = snap ? snapshot_find(snap, hash, domain, ksk) :
+		NULL;
+	if (entry) {
+		struct arena* arena = arena_thread();
+		result = LDNS_STATUS_OK;
+		if (entry->cert) {
+			record->cert = arena_strdup(arena, entry->cert);
+			if (!record->cert)
+				result = LDNS_STATUS_MEM_ERR;
+		}
+		if (entry->dnskey) {
+			record->dnskey = arena_alloc(arena, entry->dnskey_len);
+			if (record->dnskey) {
+				memcpy(record->dnskey, entry->dnskey, entry->dnskey_len);
+				record->dnskey_len = entry->dnskey_len;
+			} else {
+				result = LDNS_STATUS_MEM_ERR;
+			}
+		}
+	}
+	read_unlock(e);
+
+	if (!entry && verbosity >= 4)
+		fprintf(stderr, "Domain %s is not registered in database\n", domain);
+	return result;
+}
@@ -0,0 +1,212 @@
+#include "resolve.h"
+#include "chainwalk.h"
+#include "keyset.h"
+#include "pktindex.h"
+#include "sigcache.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <ldns/ldns.h>
+
+#define CHAINWALK_MAX_DEPTH 32
+
+extern int verbosity;
+
+/*
+ * Lazy chain of trust validation. Starting from the answer, each level
+ * verifies one link (RRset by DNSKEY, DNSKEY RRset by its KSK, KSK by the
+ * parent's DS) and stops as soon as the verifying key or DS is in the
+ * trusted key set, so nothing above the first trusted key is fetched or
+ * verified. ldns_dnssec_derive_trust_tree, by contrast, verifies every
+ * branch up to the root before the trusted keys are consulted.
+ */
+struct chainwalk {
+	ldns_resolver* res;
+	ldns_pkt* pkts[CHAINWALK_MAX_DEPTH * 2];
+	struct pktindex indexes[CHAINWALK_MAX_DEPTH * 2];
+	size_t count;
+};
+
+// Answer RRset for name and type; borrowed from a packet kept in walk
+static struct rrgroup*
+fetch(struct chainwalk* walk, ldns_rdf* name, ldns_rr_type type) {
+	if (walk->count == CHAINWALK_MAX_DEPTH * 2)
+		return NULL;
+	ldns_pkt* pkt;
+	query(&pkt, walk->res, name, type);
+	if (!pkt)
+		return NULL;
+	struct pktindex* index = &walk->indexes[walk->count];
+	walk->pkts[walk->count++] = pkt;
+	pktindex_build(index, pkt);
+	return pktindex_find(index, LDNS_SECTION_ANSWER, name, type);
+}
+
+// The key among keys that verifies a signature by signer over rrset
+static ldns_rr*
+verify_with(ldns_rr_list* rrset, ldns_rr_list* sigs, ldns_rdf* signer,
+			ldns_rr_list* keys, ldns_status* result) {
+	*result = LDNS_STATUS_CRYPTO_NO_MATCHING_KEYTAG_DNSKEY;
+	for (size_t s = 0; s < ldns_rr_list_rr_count(sigs); s++) {
+		ldns_rr* sig = ldns_rr_list_rr(sigs, s);
+		if (ldns_dname_compare(ldns_rr_rrsig_signame(sig), signer) != 0)
+			continue;
+		uint16_t keytag = ldns_rdf2native_int16(ldns_rr_rrsig_keytag(sig));
+		for (size_t k = 0; k < ldns_rr_list_rr_count(keys); k++) {
+			ldns_rr* key = ldns_rr_list_rr(keys, k);
+			if (ldns_calc_keytag(key) != keytag)
+				continue;
+			*result = sigcache_verify_rrsig(rrset, sig, key);
+			if (*result == LDNS_STATUS_OK)
+				return key;
+		}
+	}
+	return NULL;
+}
+
+static void
+print_step(char* what, ldns_rdf* name, ldns_rr* rr) {
+	if (verbosity < 1)
+		return;
+	printf("%s ", what);
+	ldns_rdf_print(stdout, name);
+	if (rr && ldns_rr_get_type(rr) == LDNS_RR_TYPE_DNSKEY)
+		printf(" with key %u", ldns_calc_keytag(rr));
+	printf("\n");
+}
+
+// A zone only vouches for names at or below its apex; a DS RRset belongs to
+// the parent zone, so its signer has to be a strict ancestor of the owner
+static bool
+signer_allowed(ldns_rdf* owner, ldns_rdf* signer, int parent) {
+	if (!signer)
+		return false;
+	if (ldns_dname_is_subdomain(owner, signer))
+		return true;
+	return !parent && ldns_dname_compare(owner, signer) == 0;
+}
+
+static int
+walk_chain(struct chainwalk* walk, ldns_rr_list* rrset, ldns_rr_list* sigs,
+		   struct keyset* trustedkeys, int depth, int parent);
+
+// One link of the chain: rrset by signer's keys, then up through the DS
+static int
+walk_signer(struct chainwalk* walk, ldns_rr_list* rrset, ldns_rr_list* sigs,
+			ldns_rdf* signer, struct keyset* trustedkeys, int depth) {
+	ldns_status result;
+
+	// RRset by one of the signer's keys
+	struct rrgroup* dnskeys = fetch(walk, signer, LDNS_RR_TYPE_DNSKEY);
+	if (!dnskeys || ldns_rr_list_rr_count(dnskeys->rrs) == 0)
+		return LDNS_STATUS_CRYPTO_NO_DNSKEY;
+	ldns_rr* key = verify_with(rrset, sigs, signer, dnskeys->rrs, &result);
+	if (!key)
+		return result;
+	print_step("Verified RRset signed by", signer, key);
+	if (keyset_find(trustedkeys, key)) {
+		print_step("Trusted key reached at", signer, key);
+		return LDNS_STATUS_OK;
+	}
+
+	// DNSKEY RRset by its KSK
+	ldns_rr* ksk = verify_with(dnskeys->rrs, dnskeys->sigs, signer,
+							   dnskeys->rrs, &result);
+	if (!ksk)
+		return result;
+	print_step("Verified DNSKEY RRset of", signer, ksk);
+	if (keyset_find(trustedkeys, ksk)) {
+		print_step("Trusted key reached at", signer, ksk);
+		return LDNS_STATUS_OK;
+	}
+	if (ldns_dname_label_count(signer) == 0)
+		return LDNS_STATUS_CRYPTO_NO_TRUSTED_DNSKEY;
+
+	// KSK by the parent's DS, whose RRset is the next link
+	struct rrgroup* ds = fetch(walk, signer, LDNS_RR_TYPE_DS);
+	if (!ds || ldns_rr_list_rr_count(ds->rrs) == 0)
+		return LDNS_STATUS_CRYPTO_NO_DS;
+	ldns_rr* match = NULL;
+	for (size_t i = 0; !match && i < ldns_rr_list_rr_count(ds->rrs); i++) {
+		if (ldns_rr_compare_ds(ksk, ldns_rr_list_rr(ds->rrs, i)))
+			match = ldns_rr_list_rr(ds->rrs, i);
+	}
+	if (!match)
+		return LDNS_STATUS_CRYPTO_NO_MATCHING_KEYTAG_DNSKEY;
+	print_step("Matched DS of", signer, NULL);
+	if (keyset_find(trustedkeys, match)) {
+		print_step("Trusted DS reached at", signer, NULL);
+		return LDNS_STATUS_OK;
+	}
+	return walk_chain(walk, ds->rrs, ds->sigs, trustedkeys, depth + 1, 1);
+}
+
+// Tries every allowed signer of rrset in turn until one reaches a trusted key
+static int
+walk_chain(struct chainwalk* walk, ldns_rr_list* rrset, ldns_rr_list* sigs,
+		   struct keyset* trustedkeys, int depth, int parent) {
+	if (depth == CHAINWALK_MAX_DEPTH)
+		return LDNS_STATUS_CRYPTO_NO_TRUSTED_DNSKEY;
+	if (!rrset || ldns_rr_list_rr_count(rrset) == 0 || !sigs)
+		return LDNS_STATUS_CRYPTO_NO_RRSIG;
+	ldns_rdf* owner = ldns_rr_owner(ldns_rr_list_rr(rrset, 0));
+
+	int result = LDNS_STATUS_CRYPTO_NO_RRSIG;
+	for (size_t s = 0; s < ldns_rr_list_rr_count(sigs); s++) {
+		ldns_rdf* signer = ldns_rr_rrsig_signame(ldns_rr_list_rr(sigs, s));
+		if (!signer_allowed(owner, signer, parent)) {
+			if (verbosity >= 1) {
+				printf("Ignoring signature of ");
+				ldns_rdf_print(stdout, owner);
+				printf(" by ");
+				ldns_rdf_print(stdout, signer);
+				printf("\n");
+			}
+			continue;
+		}
+		size_t t = 0;
+		while (t < s && ldns_dname_compare(signer, ldns_rr_rrsig_signame(
+						   ldns_rr_list_rr(sigs, t))) != 0)
+			t++;
+		if (t < s)
+			continue;
+		result = walk_signer(walk, rrset, sigs, signer, trustedkeys, depth);
+		if (result == LDNS_STATUS_OK)
+			break;
+	}
+	return result;
+}
+
+int
+chainwalk_verify(ldns_resolver* res, ldns_rr_list* rrset, ldns_rr_list* sigs,
+				 struct keyset* trustedkeys) {
+	if (verbosity >= 0)
+		printf(
+			   "\n-------------------------\n"
+			   "Walking Trust Chain\n"
+			   "-------------------------\n");
+	if (keyset_count(trustedkeys) == 0) {
+		if (verbosity >= 0)
+			printf("You have not provided any trusted keys.\n");
+		return LDNS_STATUS_CRYPTO_NO_TRUSTED_DNSKEY;
+	}
+
+	struct chainwalk walk;
+	walk.res = res;
+	walk.count = 0;
+	int result = walk_chain(&walk, rrset, sigs, trustedkeys, 0, 0);
+	for (size_t i = 0; i < walk.count; i++) {
+		pktindex_free(&walk.indexes[i]);
+		ldns_pkt_free(walk.pkts[i]);
+	}
+
+	if (verbosity >= 0) {
+		if (result == LDNS_STATUS_OK)
+			printf("Chain verified.\n\n");
+		else
+			printf("No trusted keys found in chain: %s\n",
+				   ldns_get_errorstr_by_id(result));
+	}
+	return result;
+}
@@ -0,0 +1,25 @@
+#include "hash.h"
+
+#include <ctype.h>
+
+#define FNV_PRIME 16777619u
+
+// FNV-1a; pass HASH_SEED to start a new hash or a previous result to chain
+uint32_t
+hash_bytes(const uint8_t* data, size_t len, uint32_t hash) {
+	for (size_t i = 0; i < len; i++) {
+		hash ^= data[i];
+		hash *= FNV_PRIME;
+	}
+	return hash;
+}
+
+// As hash_bytes, but ignoring case so equal owner names hash equally
+uint32_t
+hash_dname(const uint8_t* data, size_t len, uint32_t hash) {
+	for (size_t i = 0; i < len; i++) {
+		hash ^= tolower(data[i]);
+		hash *= FNV_PRIME;
+	}
+	return hash;
+}
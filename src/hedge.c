@@ -0,0 +1,241 @@
+#include "hedge.h"
+#include "upstream.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+
+#include <ldns/ldns.h>
+
+#define HEDGE_DEFAULT_DELAY 200
+#define HEDGE_MIN_DELAY 10
+#define HEDGE_BURST 10
+#define HEDGE_MAX_ANSWER 65535
+
+extern int verbosity;
+
+/*
+ * Hedged UDP queries: if the selected upstream has not answered within the
+ * p95 RTT seen so far, the same question goes to the next upstream (or is
+ * resent) and whichever valid answer arrives first is used. Extra queries
+ * are capped at budget percent of all queries, plus a small burst.
+ */
+static int budget = 0;
+static unsigned long queries = 0;
+static unsigned long hedges = 0;
+static pthread_mutex_t hedge_lock = PTHREAD_MUTEX_INITIALIZER;
+
+struct hedge_target {
+	int fd;
+	ldns_rdf* server;
+	struct timeval sent;
+};
+
+void
+hedge_set_budget(int percent) {
+	budget = percent;
+}
+
+int
+hedge_enabled(void) {
+	return budget > 0;
+}
+
+static int
+take_hedge(void) {
+	int allowed;
+	pthread_mutex_lock(&hedge_lock);
+	allowed = hedges * 100 < queries * budget + HEDGE_BURST * 100;
+	if (allowed)
+		hedges++;
+	pthread_mutex_unlock(&hedge_lock);
+	return allowed;
+}
+
+static long
+elapsed_ms(struct timeval* since) {
+	struct timeval now;
+	gettimeofday(&now, NULL);
+	return (now.tv_sec - since->tv_sec) * 1000 +
+		(now.tv_usec - since->tv_usec) / 1000;
+}
+
+// Connected UDP socket, so the kernel drops datagrams from other sources
+static int
+send_to(struct hedge_target* target, ldns_resolver* res, uint8_t* wire,
+		size_t wire_len) {
+	size_t addrlen;
+	struct sockaddr_storage* addr =
+		ldns_rdf2native_sockaddr_storage(target->server,
+										 ldns_resolver_port(res), &addrlen);
+	if (!addr)
+		return -1;
+	target->fd = socket(addr->ss_family, SOCK_DGRAM, IPPROTO_UDP);
+	if (target->fd < 0 ||
+		connect(target->fd, (struct sockaddr*) addr, (socklen_t) addrlen) != 0 ||
+		send(target->fd, wire, wire_len, 0) != (ssize_t) wire_len) {
+		if (target->fd >= 0)
+			close(target->fd);
+		target->fd = -1;
+		free(addr);
+		return -1;
+	}
+	free(addr);
+	gettimeofday(&target->sent, NULL);
+	return 0;
+}
+
+// Accept only a response to our question, not a stray or spoofed datagram
+static ldns_pkt*
+read_answer(int fd, ldns_pkt* q) {
+	uint8_t buf[HEDGE_MAX_ANSWER];
+	ssize_t n = recv(fd, buf, sizeof(buf), 0);
+	if (n < 12)
+		return NULL;
+
+	ldns_pkt* answer;
+	if (ldns_wire2pkt(&answer, buf, n) != LDNS_STATUS_OK)
+		return NULL;
+	ldns_rr_list* question = ldns_pkt_question(answer);
+	ldns_rr* qrr = ldns_rr_list_rr(ldns_pkt_question(q), 0);
+	if (!ldns_pkt_qr(answer) || ldns_pkt_id(answer) != ldns_pkt_id(q) ||
+		ldns_rr_list_rr_count(question) != 1 ||
+		ldns_rr_get_type(ldns_rr_list_rr(question, 0)) != ldns_rr_get_type(qrr) ||
+		ldns_dname_compare(ldns_rr_owner(ldns_rr_list_rr(question, 0)),
+						   ldns_rr_owner(qrr)) != 0) {
+		ldns_pkt_free(answer);
+		return NULL;
+	}
+	ldns_pkt_set_size(answer, n);
+	return answer;
+}
+
+// LDNS_STATUS_NETWORK_ERR: an upstream was still pending when the resolver
+// timeout ran out. LDNS_STATUS_SOCKET_ERROR: no send succeeded or every
+// socket failed early, so other nameservers are still worth trying.
+int
+hedge_query(ldns_pkt** p, ldns_resolver* res, ldns_rdf* domain,
+			ldns_rr_type rtype) {
+	*p = NULL;
+	size_t count = ldns_resolver_nameserver_count(res);
+	if (count == 0)
+		return LDNS_STATUS_RES_NO_NS;
+	ldns_rdf** ns = ldns_resolver_nameservers(res);
+
+	ldns_pkt* q;
+	int result = ldns_resolver_prepare_query_pkt(&q, res, domain, rtype,
+												 LDNS_RR_CLASS_IN, LDNS_RD);
+	if (result != LDNS_STATUS_OK)
+		return result;
+	uint8_t* wire;
+	size_t wire_len;
+	if (ldns_pkt2wire(&wire, q, &wire_len) != LDNS_STATUS_OK) {
+		ldns_pkt_free(q);
+		return LDNS_STATUS_ERR;
+	}
+
+	pthread_mutex_lock(&hedge_lock);
+	queries++;
+	pthread_mutex_unlock(&hedge_lock);
+
+	int delay = upstream_rtt_p95();
+	if (delay < 0)
+		delay = HEDGE_DEFAULT_DELAY;
+	else if (delay < HEDGE_MIN_DELAY)
+		delay = HEDGE_MIN_DELAY;
+	struct timeval timeout = ldns_resolver_timeout(res);
+	long timeout_ms = timeout.tv_sec * 1000 + timeout.tv_usec / 1000;
+
+	// upstream_select has already put the preferred server first
+	struct hedge_target targets[2] = { { -1, ns[0] }, { -1, NULL } };
+	int sent = 0;
+	if (send_to(&targets[0], res, wire, wire_len) == 0)
+		sent = 1;
+
+	struct timeval start;
+	gettimeofday(&start, NULL);
+	int winner = -1;
+	result = LDNS_STATUS_SOCKET_ERROR;
+	while (elapsed_ms(&start) < timeout_ms) {
+		long wait = timeout_ms - elapsed_ms(&start);
+		if (!targets[1].server) {
+			if (sent > 0 && elapsed_ms(&start) < delay) {
+				wait = delay - elapsed_ms(&start);
+			} else {
+				// Threshold passed or the first upstream failed outright:
+				// hedge once if allowed
+				targets[1].server = ns[count > 1 ? 1 : 0];
+				if (take_hedge()) {
+					if (verbosity >= 2) {
+						printf("Hedging query to ");
+						ldns_rdf_print(stdout, targets[1].server);
+						printf(" after %ld ms\n", elapsed_ms(&start));
+					}
+					if (send_to(&targets[1], res, wire, wire_len) == 0)
+						sent++;
+				}
+				continue;
+			}
+		}
+		if (sent == 0)
+			break;
+
+		struct pollfd pfd[2];
+		int map[2];
+		int nfds = 0;
+		for (int i = 0; i < 2; i++) {
+			if (targets[i].fd >= 0) {
+				pfd[nfds].fd = targets[i].fd;
+				pfd[nfds].events = POLLIN;
+				pfd[nfds].revents = 0;
+				map[nfds++] = i;
+			}
+		}
+		int ready = poll(pfd, nfds, wait > 0 ? wait : 0);
+		if (ready < 0 && errno != EINTR)
+			break;
+		for (int i = 0; i < nfds && winner < 0; i++) {
+			if (pfd[i].revents & (POLLERR | POLLHUP | POLLNVAL)) {
+				// e.g. ICMP port unreachable; nothing will arrive on this
+				// socket, and leaving it open would make poll spin
+				close(pfd[i].fd);
+				targets[map[i]].fd = -1;
+				sent--;
+				continue;
+			}
+			if (!(pfd[i].revents & POLLIN))
+				continue;
+			ldns_pkt* answer = read_answer(pfd[i].fd, q);
+			if (answer) {
+				*p = answer;
+				winner = map[i];
+			}
+		}
+		if (winner >= 0)
+			break;
+	}
+
+	if (winner >= 0) {
+		struct hedge_target* target = &targets[winner];
+		ldns_pkt_set_answerfrom(*p, ldns_rdf_clone(target->server));
+		ldns_pkt_set_querytime(*p, elapsed_ms(&target->sent));
+		upstream_report(target->server, *p);
+		result = LDNS_STATUS_OK;
+	} else if (sent > 0 && elapsed_ms(&start) >= timeout_ms) {
+		result = LDNS_STATUS_NETWORK_ERR;
+	}
+	for (int i = 0; i < 2; i++) {
+		if (targets[i].fd >= 0)
+			close(targets[i].fd);
+	}
+	free(wire);
+	ldns_pkt_free(q);
+	return result;
+}
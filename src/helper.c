@@ -1,9 +1,12 @@
 #include "helper.h"
+#include "arena.h"
+#include "singleflight.h"
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <ctype.h>
+#include <pthread.h>
 
 #include <mysql/mysql.h>
 
@@ -17,91 +20,305 @@ extern verbosity;
 void
 get_config(char *filename, struct dbconfig* configstruct) {
 	FILE *file = fopen(filename, "r");
+	struct arena* arena = arena_thread();
 
+	configstruct->username = NULL;
+	configstruct->password = NULL;
+	configstruct->dbname = NULL;
 	if (file != NULL) {
 		char line[MAXBUF];
 
 		while(fgets(line, sizeof(line), file) != NULL) {
 			char *cfline;
 			cfline = strstr((char *)line,DELIM);
+			if (cfline == NULL)
+				continue;
 			cfline = cfline + strlen(DELIM);
 			if(strlen(cfline) && isspace(cfline[strlen(cfline)-1])) {
 				cfline[strlen(cfline)-1] = '\0';
 			}
 
-			int length = strlen(cfline)+1;
 			if (strncmp(line, "username", 8) == 0) {
-				configstruct->username = malloc(sizeof(char)*length);
-				memcpy(configstruct->username, cfline, length);
+				configstruct->username = arena_strdup(arena, cfline);
 			} else if (strncmp(line, "password", 8) == 0) {
-				configstruct->password = malloc(sizeof(char)*length);
-				memcpy(configstruct->password, cfline, length);
+				configstruct->password = arena_strdup(arena, cfline);
 			} else if (strncmp(line, "dbname", 6) == 0) {
-				configstruct->dbname = malloc(sizeof(char)*length);
-				memcpy(configstruct->dbname, cfline, length);
+				configstruct->dbname = arena_strdup(arena, cfline);
 			}
 		}
 		fclose(file);
 	}
 }
 
-int
-get_mysql_cert(char* configfile, char* domain, char** cert, int ksk) {
-	MYSQL* con = mysql_init(NULL);
-	if (con == NULL) {
+/*
+ * Each thread keeps one connection and one prepared lookup statement, so a
+ * lookup is a single binary-protocol execute against the (domain, ksk)
+ * index rather than a connect, a text query and a disconnect. The
+ * connection is closed when the thread exits.
+ */
+struct lookup_conn {
+	MYSQL* con;
+	MYSQL_STMT* stmt;
+};
+
+static pthread_key_t lookup_key;
+static pthread_once_t lookup_once = PTHREAD_ONCE_INIT;
+
+static const char* LOOKUP_DNSKEY =
+	"SELECT cert, dnskey FROM certificates WHERE domain=? AND ksk=? LIMIT 1";
+static const char* LOOKUP_CERT =
+	"SELECT cert, NULL FROM certificates WHERE domain=? AND ksk=? LIMIT 1";
+
+static void
+lookup_close(struct lookup_conn* conn) {
+	if (conn->stmt)
+		mysql_stmt_close(conn->stmt);
+	if (conn->con)
+		mysql_close(conn->con);
+	conn->stmt = NULL;
+	conn->con = NULL;
+}
+
+static void
+lookup_destroy(void* arg) {
+	lookup_close(arg);
+	free(arg);
+	mysql_thread_end();
+}
+
+static void
+lookup_init(void) {
+	pthread_key_create(&lookup_key, lookup_destroy);
+}
+
+static struct lookup_conn*
+lookup_thread(void) {
+	pthread_once(&lookup_once, lookup_init);
+	struct lookup_conn* conn = pthread_getspecific(lookup_key);
+	if (!conn) {
+		conn = calloc(1, sizeof(struct lookup_conn));
+		if (conn)
+			pthread_setspecific(lookup_key, conn);
+	}
+	return conn;
+}
+
+static int
+prepare_lookup(struct lookup_conn* conn, char* configfile) {
+	if (conn->stmt)
+		return LDNS_STATUS_OK;
+
+	conn->con = mysql_init(NULL);
+	if (conn->con == NULL) {
 		fprintf(stderr, "mysql_init() failed\n");
 		return LDNS_STATUS_ERR;
 	}
 
-	int result;
 	struct dbconfig config;
 	get_config(configfile, &config);
+	if (mysql_real_connect(conn->con, "localhost", config.username,
+						   config.password, config.dbname, 0, NULL, 0) == NULL) {
+		fprintf(stderr, "%s\n", mysql_error(conn->con));
+		lookup_close(conn);
+		return LDNS_STATUS_ERR;
+	}
 
-	if (mysql_real_connect(con, "localhost", config.username, config.password,
-						   config.dbname, 0, NULL, 0) == NULL) {
-		fprintf(stderr, "%s\n", mysql_error(con));
-		result = LDNS_STATUS_ERR;
-		goto finish;
+	// Tables that have not been migrated yet have no dnskey column
+	conn->stmt = mysql_stmt_init(conn->con);
+	if (conn->stmt == NULL ||
+		(mysql_stmt_prepare(conn->stmt, LOOKUP_DNSKEY, strlen(LOOKUP_DNSKEY)) &&
+		 mysql_stmt_prepare(conn->stmt, LOOKUP_CERT, strlen(LOOKUP_CERT)))) {
+		fprintf(stderr, "%s\n", conn->stmt ? mysql_stmt_error(conn->stmt)
+				: mysql_error(conn->con));
+		lookup_close(conn);
+		return LDNS_STATUS_ERR;
 	}
+	return LDNS_STATUS_OK;
+}
 
-	char query[MAXBUF];
-	sprintf(query, "SELECT cert FROM certificates WHERE domain='%s' AND ksk=%d", domain, ksk);
-	if (mysql_query(con, query)) {
-		if (verbosity >= 4)
-			fprintf(stderr, "%s\n", mysql_error(con));
-		result = LDNS_STATUS_ERR;
-		goto finish;
+// Closes the calling thread's connection; other threads close theirs on exit
+void
+close_mysql(void) {
+	pthread_once(&lookup_once, lookup_init);
+	struct lookup_conn* conn = pthread_getspecific(lookup_key);
+	if (conn) {
+		lookup_close(conn);
+		free(conn);
+		pthread_setspecific(lookup_key, NULL);
 	}
+}
 
-	MYSQL_RES* mysql_result = mysql_store_result(con);
-	if (mysql_result == NULL) {
-		if (verbosity >= 4)
-			fprintf(stderr, "%s\n", mysql_error(con));
-		result = LDNS_STATUS_ERR;
-		goto finish;
+/*
+ * Connects if needed, then executes the lookup. A connection that has gone
+ * stale, e.g. closed by the server after wait_timeout, is replaced and the
+ * lookup retried once.
+ */
+static int
+execute_lookup(struct lookup_conn* conn, char* configfile, MYSQL_BIND* param,
+			   MYSQL_BIND* column) {
+	for (int attempt = 0; attempt <= 1; attempt++) {
+		int result = prepare_lookup(conn, configfile);
+		if (result != LDNS_STATUS_OK)
+			return result;
+		if (!mysql_stmt_bind_param(conn->stmt, param) &&
+			!mysql_stmt_execute(conn->stmt) &&
+			!mysql_stmt_bind_result(conn->stmt, column))
+			return LDNS_STATUS_OK;
+
+		if (attempt > 0 || verbosity >= 2)
+			fprintf(stderr, "%s\n", mysql_stmt_error(conn->stmt));
+		lookup_close(conn);
 	}
+	return LDNS_STATUS_ERR;
+}
 
-	MYSQL_ROW row = mysql_fetch_row(mysql_result);
-	if (row == 0) {
+static int
+lookup_cert(char* configfile, char* domain, struct certrecord* record,
+			int ksk) {
+	record->cert = NULL;
+	record->dnskey = NULL;
+	record->dnskey_len = 0;
+
+	struct lookup_conn* conn = lookup_thread();
+	if (!conn)
+		return LDNS_STATUS_MEM_ERR;
+
+	MYSQL_BIND param[2];
+	memset(param, 0, sizeof(param));
+	unsigned long domain_len = strlen(domain);
+	param[0].buffer_type = MYSQL_TYPE_STRING;
+	param[0].buffer = domain;
+	param[0].buffer_length = domain_len;
+	param[0].length = &domain_len;
+	param[1].buffer_type = MYSQL_TYPE_LONG;
+	param[1].buffer = &ksk;
+
+	// Fetch lengths first, then each column into a buffer of the right size
+	MYSQL_BIND column[2];
+	unsigned long length[2] = { 0, 0 };
+	bool is_null[2] = { 1, 1 };
+	memset(column, 0, sizeof(column));
+	for (int i = 0; i < 2; i++) {
+		column[i].buffer_type = MYSQL_TYPE_BLOB;
+		column[i].length = &length[i];
+		column[i].is_null = &is_null[i];
+	}
+
+	int result = execute_lookup(conn, configfile, param, column);
+	if (result != LDNS_STATUS_OK)
+		return result;
+	MYSQL_STMT* lookup_stmt = conn->stmt;
+
+	int fetch = mysql_stmt_fetch(lookup_stmt);
+	if (fetch == MYSQL_NO_DATA) {
 		if (verbosity >= 4)
 			fprintf(stderr, "Domain %s is not registered in database\n", domain);
 		result = LDNS_STATUS_ERR;
-		goto finish;
-	} else if (row[0] == NULL) {
-		result = LDNS_STATUS_OK;
-		*cert = NULL;
-		goto finish;
+	} else if (fetch != 0 && fetch != MYSQL_DATA_TRUNCATED) {
+		if (verbosity >= 4)
+			fprintf(stderr, "%s\n", mysql_stmt_error(lookup_stmt));
+		result = LDNS_STATUS_ERR;
+	} else {
+		struct arena* arena = arena_thread();
+		if (!is_null[0])
+			record->cert = arena_alloc(arena, length[0] + 1);
+		if (record->cert) {
+			column[0].buffer = record->cert;
+			column[0].buffer_length = length[0];
+			mysql_stmt_fetch_column(lookup_stmt, &column[0], 0, 0);
+			record->cert[length[0]] = '\0';
+		}
+		if (!is_null[1] && length[1] > 0)
+			record->dnskey = arena_alloc(arena, length[1]);
+		if (record->dnskey) {
+			record->dnskey_len = length[1];
+			column[1].buffer = record->dnskey;
+			column[1].buffer_length = length[1];
+			mysql_stmt_fetch_column(lookup_stmt, &column[1], 1, 0);
+		}
+		result = (is_null[0] || record->cert) &&
+			(is_null[1] || length[1] == 0 || record->dnskey) ?
+			LDNS_STATUS_OK : LDNS_STATUS_MEM_ERR;
+	}
+	mysql_stmt_free_result(lookup_stmt);
+	return result;
+}
+
+static void*
+certrecord_copy(const void* value) {
+	const struct certrecord* record = value;
+	struct certrecord* copy = calloc(1, sizeof(struct certrecord));
+	if (!copy)
+		return NULL;
+	if (record->cert)
+		copy->cert = strdup(record->cert);
+	if (record->dnskey_len > 0) {
+		copy->dnskey = malloc(record->dnskey_len);
+		if (copy->dnskey) {
+			memcpy(copy->dnskey, record->dnskey, record->dnskey_len);
+			copy->dnskey_len = record->dnskey_len;
+		}
 	}
+	return copy;
+}
 
-	*cert = malloc(sizeof(char)*(strlen(row[0])+1));
-	strncpy(*cert, *row, strlen(row[0])+1);
-	mysql_free_result(mysql_result);
-	result = LDNS_STATUS_OK;
+static void
+certrecord_free(void* value) {
+	struct certrecord* record = value;
+	free(record->cert);
+	free(record->dnskey);
+	free(record);
+}
+
+// Concurrent lookups of the same (domain, ksk) share one database query
+static struct singleflight inflight_certs =
+	SINGLEFLIGHT_INIT(certrecord_copy, certrecord_free);
+
+int
+get_mysql_cert(char* configfile, char* domain, struct certrecord* record,
+			   int ksk) {
+	size_t domain_len = strlen(domain);
+	char* key = arena_alloc(arena_thread(), domain_len + 1);
+	if (!key)
+		return LDNS_STATUS_MEM_ERR;
+	for (size_t i = 0; i < domain_len; i++)
+		key[i] = tolower((unsigned char) domain[i]);
+	key[domain_len] = ksk ? 1 : 0;
 
- finish:
-	mysql_close(con);
-	free(config.username);
-	free(config.password);
-	free(config.dbname);
+	int leader;
+	struct flight* flight =
+		singleflight_join(&inflight_certs, key, domain_len + 1, &leader);
+	if (leader) {
+		int result = lookup_cert(configfile, domain, record, ksk);
+		singleflight_done(&inflight_certs, flight, result, record);
+		return result;
+	}
+
+	const void* value;
+	int result = singleflight_wait(&inflight_certs, flight, &value);
+	const struct certrecord* shared = value;
+	struct arena* arena = arena_thread();
+	record->cert = NULL;
+	record->dnskey = NULL;
+	record->dnskey_len = 0;
+	if (result == LDNS_STATUS_OK && !shared) {
+		result = LDNS_STATUS_MEM_ERR;
+	} else if (result == LDNS_STATUS_OK) {
+		if (shared->cert) {
+			record->cert = arena_strdup(arena, shared->cert);
+			if (!record->cert)
+				result = LDNS_STATUS_MEM_ERR;
+		}
+		if (shared->dnskey_len > 0) {
+			record->dnskey = arena_alloc(arena, shared->dnskey_len);
+			if (record->dnskey) {
+				memcpy(record->dnskey, shared->dnskey, shared->dnskey_len);
+				record->dnskey_len = shared->dnskey_len;
+			} else {
+				result = LDNS_STATUS_MEM_ERR;
+			}
+		}
+	}
+	singleflight_release(&inflight_certs, flight);
 	return result;
 }
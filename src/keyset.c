@@ -0,0 +1,222 @@
+#include "keyset.h"
+#include "hash.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <ldns/ldns.h>
+
+#define KEYSET_BUCKETS 64
+
+extern int verbosity;
+
+/*
+ * Trusted DNSKEY and DS records indexed by (owner, key tag, algorithm), so
+ * matching a trust tree node against the anchors is a single bucket probe
+ * rather than a comparison against every loaded key.
+ */
+struct keyset_entry {
+	ldns_rr* rr;
+	uint32_t hash;
+	uint32_t rdata_hash;
+	uint16_t keytag;
+	uint8_t algorithm;
+	struct keyset_entry* next;
+};
+
+struct keyset {
+	struct keyset_entry** buckets;
+	size_t bucket_count;
+	size_t count;
+};
+
+// Only DNSKEY and DS records carry a key tag and algorithm
+static int
+key_id(ldns_rr* rr, uint16_t* keytag, uint8_t* algorithm) {
+	if (ldns_rr_get_type(rr) == LDNS_RR_TYPE_DNSKEY &&
+		ldns_rr_rd_count(rr) >= 4) {
+		*keytag = ldns_calc_keytag(rr);
+		*algorithm = ldns_rdf2native_int8(ldns_rr_rdf(rr, 2));
+		return 1;
+	} else if (ldns_rr_get_type(rr) == LDNS_RR_TYPE_DS &&
+			   ldns_rr_rd_count(rr) >= 4) {
+		*keytag = ldns_rdf2native_int16(ldns_rr_rdf(rr, 0));
+		*algorithm = ldns_rdf2native_int8(ldns_rr_rdf(rr, 1));
+		return 1;
+	}
+	return 0;
+}
+
+static uint32_t
+key_hash(ldns_rr* rr, uint16_t keytag, uint8_t algorithm) {
+	ldns_rdf* owner = ldns_rr_owner(rr);
+	uint8_t id[3] = { keytag >> 8, keytag & 0xff, algorithm };
+	uint32_t hash = hash_dname(ldns_rdf_data(owner), ldns_rdf_size(owner),
+							   HASH_SEED);
+	return hash_bytes(id, sizeof(id), hash);
+}
+
+static uint32_t
+rdata_hash(ldns_rr* rr) {
+	uint32_t hash = HASH_SEED;
+	for (size_t i = 0; i < ldns_rr_rd_count(rr); i++) {
+		ldns_rdf* rdf = ldns_rr_rdf(rr, i);
+		hash = hash_bytes(ldns_rdf_data(rdf), ldns_rdf_size(rdf), hash);
+	}
+	return hash;
+}
+
+struct keyset*
+keyset_new(void) {
+	struct keyset* set = malloc(sizeof(struct keyset));
+	if (!set)
+		return NULL;
+	set->bucket_count = KEYSET_BUCKETS;
+	set->count = 0;
+	set->buckets = calloc(set->bucket_count, sizeof(struct keyset_entry*));
+	if (!set->buckets) {
+		free(set);
+		return NULL;
+	}
+	return set;
+}
+
+void
+keyset_free(struct keyset* set) {
+	if (!set)
+		return;
+	for (size_t i = 0; i < set->bucket_count; i++) {
+		struct keyset_entry* entry = set->buckets[i];
+		while (entry) {
+			struct keyset_entry* next = entry->next;
+			ldns_rr_free(entry->rr);
+			free(entry);
+			entry = next;
+		}
+	}
+	free(set->buckets);
+	free(set);
+}
+
+static void
+keyset_grow(struct keyset* set) {
+	size_t bucket_count = set->bucket_count * 2;
+	struct keyset_entry** buckets =
+		calloc(bucket_count, sizeof(struct keyset_entry*));
+	if (!buckets)
+		return;
+	for (size_t i = 0; i < set->bucket_count; i++) {
+		struct keyset_entry* entry = set->buckets[i];
+		while (entry) {
+			struct keyset_entry* next = entry->next;
+			size_t b = entry->hash & (bucket_count - 1);
+			entry->next = buckets[b];
+			buckets[b] = entry;
+			entry = next;
+		}
+	}
+	free(set->buckets);
+	set->buckets = buckets;
+	set->bucket_count = bucket_count;
+}
+
+ldns_rr*
+keyset_find(struct keyset* set, ldns_rr* rr) {
+	uint16_t keytag;
+	uint8_t algorithm;
+	if (!set || !rr || !key_id(rr, &keytag, &algorithm))
+		return NULL;
+
+	uint32_t hash = key_hash(rr, keytag, algorithm);
+	uint32_t rhash = 0;
+	int have_rhash = 0;
+	struct keyset_entry* entry = set->buckets[hash & (set->bucket_count - 1)];
+	for (; entry; entry = entry->next) {
+		if (entry->hash != hash || entry->keytag != keytag ||
+			entry->algorithm != algorithm)
+			continue;
+		if (ldns_rr_get_type(entry->rr) == ldns_rr_get_type(rr)) {
+			if (!have_rhash) {
+				rhash = rdata_hash(rr);
+				have_rhash = 1;
+			}
+			if (entry->rdata_hash != rhash)
+				continue;
+		}
+		// Same semantics as ldns_dnssec_trust_tree_contains_keys: a DS
+		// anchor matches the DNSKEY it digests
+		if (ldns_rr_compare_ds(rr, entry->rr))
+			return entry->rr;
+	}
+	return NULL;
+}
+
+// Takes ownership of rr, also when it cannot be added
+int
+keyset_add(struct keyset* set, ldns_rr* rr) {
+	uint16_t keytag;
+	uint8_t algorithm;
+	if (!key_id(rr, &keytag, &algorithm)) {
+		fprintf(stderr, "Trusted keys must be DNSKEY or DS records\n");
+		ldns_rr_free(rr);
+		return LDNS_STATUS_ERR;
+	}
+
+	ldns_rr* existing = keyset_find(set, rr);
+	if (existing && ldns_rr_get_type(existing) == ldns_rr_get_type(rr)) {
+		ldns_rr_free(rr);
+		return LDNS_STATUS_OK;
+	}
+
+	struct keyset_entry* entry = malloc(sizeof(struct keyset_entry));
+	if (!entry) {
+		ldns_rr_free(rr);
+		return LDNS_STATUS_MEM_ERR;
+	}
+	entry->rr = rr;
+	entry->keytag = keytag;
+	entry->algorithm = algorithm;
+	entry->hash = key_hash(rr, keytag, algorithm);
+	entry->rdata_hash = rdata_hash(rr);
+
+	if (set->count >= set->bucket_count)
+		keyset_grow(set);
+	size_t b = entry->hash & (set->bucket_count - 1);
+	entry->next = set->buckets[b];
+	set->buckets[b] = entry;
+	set->count++;
+	return LDNS_STATUS_OK;
+}
+
+size_t
+keyset_count(struct keyset* set) {
+	return set ? set->count : 0;
+}
+
+ldns_status
+keyset_tree_contains_keys(ldns_dnssec_trust_tree* tree, struct keyset* set) {
+	if (!tree || keyset_count(set) == 0)
+		return LDNS_STATUS_ERR;
+
+	if (tree->rr && keyset_find(set, tree->rr))
+		return LDNS_STATUS_OK;
+
+	ldns_status result = LDNS_STATUS_CRYPTO_NO_DNSKEY;
+	for (size_t i = 0; i < tree->parent_count; i++) {
+		ldns_status parent_result =
+			keyset_tree_contains_keys(tree->parents[i], set);
+		if (parent_result == LDNS_STATUS_CRYPTO_NO_DNSKEY)
+			continue;
+
+		if (tree->parent_status[i] != LDNS_STATUS_OK) {
+			result = tree->parent_status[i];
+		} else if (tree->rr &&
+				   ldns_rr_get_type(tree->rr) == LDNS_RR_TYPE_NSEC &&
+				   parent_result == LDNS_STATUS_OK) {
+			result = LDNS_STATUS_DNSSEC_EXISTENCE_DENIED;
+		} else {
+			result = parent_result;
+		}
+	}
+	return result;
+}
@@ -1,4 +1,14 @@
 #include "resolve.h"
+#include "arena.h"
+#include "chainwalk.h"
+#include "certstore.h"
+#include "hedge.h"
+#include "helper.h"
+#include "keyset.h"
+#include "pktindex.h"
+#include "tcppool.h"
+#include "upstream.h"
+#include "verify.h"
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -31,12 +41,15 @@ usage(FILE *fp, char *prog) {
 	fprintf(fp, "-4\t\tonly use IPv4\n");
 	fprintf(fp, "-6\t\tonly use IPv6\n");
 	fprintf(fp, "-val-chain [-c] \t\tValidate DNSSEC chain [and check database for keys]\n");
+	fprintf(fp, "-val-lazy [-c] \t\tValidate DNSSEC chain only up to the first trusted key [and check database for keys]\n");
 	fprintf(fp, "-val-RR [-t <rrtype>] \t\tValidate requested RR [and additional records]\n");
 	fprintf(fp, "-t <rrtype>\t\tLook up this record\n");
-	fprintf(fp, "-k <key origin> -K <key string> [-KSK]\t\tAdd key to trusted keys\n");
+	fprintf(fp, "-k <key origin> -K <key string> [-KSK] [-A <algorithm>]\t\tAdd key to trusted keys\n");
+	fprintf(fp, "-preload\t\tLoad all database keys at startup and keep them refreshed\n");
+	fprintf(fp, "-hedge <percent>\t\tResend slow queries to a second nameserver, up to percent of queries\n");
 	fprintf(fp, "-v <verbosity>\t\tVerbosity level [1-5]\n");
 	fprintf(fp, "-version\tShow version and exit\n");
-	fprintf(fp, "@<nameserver>\t\tUse this nameserver\n");
+	fprintf(fp, "@<nameserver>[,<nameserver>...]\t\tUse these nameservers, preferring the fastest\n");
 	return 0;
 }
 
@@ -46,18 +59,24 @@ main(int argc, char *argv[]) {
 	uint8_t fam = LDNS_RESOLV_INETANY;
 	int check_database = 0;
 	int val_chain = 0;
+	int val_lazy = 0;
 	int val_RR = 0;
+	int preload = 0;
 
 	char *arg_end_ptr = NULL;
 	char *serv = NULL;
-	const char* arg_domain = NULL;
+	char* arg_domain = NULL;
 
 	ldns_rdf *domain = NULL;
 
 	ldns_rr_type rtype = LDNS_RR_TYPE_A;
 	ldns_rr_type rtype_additional = 0;
 
-	ldns_rr_list* rrset_trustedkeys = ldns_rr_list_new();
+	struct keyset* rrset_trustedkeys = keyset_new();
+	if (!rrset_trustedkeys) {
+		fprintf(stderr, "Couldn't allocate trusted key set\n");
+		exit(EXIT_FAILURE);
+	}
 
 	if (argc < 2) {
 		usage(stdout, argv[0]);
@@ -84,6 +103,14 @@ main(int argc, char *argv[]) {
 						i++;
 					}
 				}
+			} else if (strcmp("-val-lazy", argv[i]) == 0) {
+				val_lazy = 1;
+				if (i + 1 < argc) {
+					if (strncmp(argv[i + 1], "-c", 3) == 0) {
+						check_database = 1;
+						i++;
+					}
+				}
 			} else if (strcmp("-val-RR", argv[i]) == 0) {
 				val_RR = 1;
 				if (i + 1 < argc) {
@@ -147,9 +174,21 @@ main(int argc, char *argv[]) {
 							ksk = 1;
 							i++;
 						}
+						uint8_t algorithm = ALG_ECDSAP256SHA256;
+						if ((i + 3 < argc) &&
+							(strncmp(argv[i + 2], "-A", 3) == 0)) {
+							long value = strtol(argv[i + 3], &arg_end_ptr, 10);
+							if (*arg_end_ptr != '\0' || value < 1 ||
+								value > 255) {
+								printf("Bad argument for -A: %s\n", argv[i + 3]);
+								exit(1);
+							}
+							algorithm = value;
+							i+=2;
+						}
 						ldns_rr* rr_trustedkey;
 						result = trustedkey_fromkey(&rr_trustedkey, key,
-													origin, ksk);
+													origin, ksk, algorithm);
 						if (result != LDNS_STATUS_OK)
 							goto exit;
 
@@ -169,6 +208,21 @@ main(int argc, char *argv[]) {
 			} else if (strncmp(argv[i], "-K", 3) == 0) {
 				printf("Missing argument for -k\n");
 				exit(1);
+			} else if (strcmp("-preload", argv[i]) == 0) {
+				preload = 1;
+			} else if (strcmp("-hedge", argv[i]) == 0) {
+				if (i + 1 < argc) {
+					int budget = strtol(argv[i+1], &arg_end_ptr, 10);
+					if (*arg_end_ptr != '\0' || budget < 0 || budget > 100) {
+						printf("Bad argument for -hedge: %s\n", argv[i+1]);
+						exit(1);
+					}
+					hedge_set_budget(budget);
+				} else {
+					printf("Missing argument for -hedge\n");
+					exit(1);
+				}
+				i++;
 			} else if (strncmp(argv[i], "-v", 3) == 0) {
 				if (i + 1 < argc) {
 					verbosity = strtol(argv[i+1], &arg_end_ptr, 10);
@@ -224,6 +278,13 @@ main(int argc, char *argv[]) {
 		exit(1);
 	}
 
+	// Load database keys up front so validation never waits on MySQL
+	if (preload) {
+		result = certstore_start(CONFIG_FILE);
+		if (result != LDNS_STATUS_OK)
+			goto exit;
+	}
+
 	// Create resolver
 	ldns_resolver *res;
 	result = create_resolver(&res, serv);
@@ -242,11 +303,14 @@ main(int argc, char *argv[]) {
 	// Make query
 	ldns_pkt* pkt;
 	query(&pkt, res, domain, rtype);
-	ldns_rr_list* rrset =
-		ldns_pkt_rr_list_by_type(pkt, rtype, LDNS_SECTION_ANSWER);
-	if (!rrset) {
+	struct pktindex index;
+	pktindex_build(&index, pkt);
+	struct rrgroup* answer =
+		pktindex_find(&index, LDNS_SECTION_ANSWER, NULL, rtype);
+	if (!answer) {
 		fprintf(stderr, "No records for given type\n");
 		result = 3;
+		pktindex_free(&index);
 		ldns_pkt_free(pkt);
 
 		ldns_rdf_deep_free(domain);
@@ -258,25 +322,26 @@ main(int argc, char *argv[]) {
 	if (val_RR) {
 		struct timeval start, end;
 		gettimeofday(&start, NULL);
-		verify_rr(rrset,
-				  ldns_pkt_rr_list_by_type(pkt, LDNS_RR_TYPE_RRSIG,
-										   LDNS_SECTION_ANSWER),
-				  arg_domain, rtype);
+		verify_rr(answer->rrs, answer->sigs, arg_domain, rtype);
 		gettimeofday(&end, NULL);
 		show_time(start, end);
 
 		if (rtype_additional) {
+			struct rrgroup* additional =
+				pktindex_find(&index, LDNS_SECTION_ADDITIONAL, NULL,
+							  rtype_additional);
 			gettimeofday(&start, NULL);
-			verify_rr(ldns_pkt_rr_list_by_type(pkt, rtype_additional,
-											   LDNS_SECTION_ADDITIONAL),
-					  ldns_pkt_rr_list_by_type(pkt, LDNS_RR_TYPE_RRSIG,
-											   LDNS_SECTION_ADDITIONAL),
+			verify_rr(additional ? additional->rrs : NULL,
+					  additional ? additional->sigs : NULL,
 					  arg_domain, rtype_additional);
 			gettimeofday(&end, NULL);
 			show_time(start, end);
 		}
 	}
 
+	// Buffers from the RR checks are no longer referenced
+	arena_reset(arena_thread());
+
 	// Populate trusted key list from database
 	if (check_database) {
 		result = populate_trustedkeys(rrset_trustedkeys, arg_domain);
@@ -290,7 +355,7 @@ main(int argc, char *argv[]) {
 		ldns_dnssec_trust_tree* tree;
 		struct timeval start, end;
 		gettimeofday(&start, NULL);
-		result = verify_trust(&chain, &tree, res, rrset, pkt);
+		result = verify_trust(&chain, &tree, res, answer->rrs, pkt);
 
 		// Check trusted keys exist in chain of trust
 		if (result == LDNS_STATUS_OK) {
@@ -302,15 +367,30 @@ main(int argc, char *argv[]) {
 		ldns_dnssec_data_chain_deep_free(chain);
 	}
 
+	// Walk up from the answer only until a trusted key is reached
+	if (val_lazy) {
+		struct timeval start, end;
+		gettimeofday(&start, NULL);
+		result = chainwalk_verify(res, answer->rrs, answer->sigs,
+								  rrset_trustedkeys);
+		gettimeofday(&end, NULL);
+		show_time(start, end);
+	}
+
 	// Cleanup
  cleanup:
-	ldns_rr_list_deep_free(rrset);
+	pktindex_free(&index);
 	ldns_pkt_free(pkt);
 
 	ldns_rdf_deep_free(domain);
 	ldns_resolver_deep_free(res);
  exit:
-	ldns_rr_list_deep_free(rrset_trustedkeys);
+	certstore_stop();
+	close_mysql();
+	keyset_free(rrset_trustedkeys);
+	tcppool_free();
+	upstream_free();
+	arena_thread_free();
 
 	return result;
 }
@@ -0,0 +1,485 @@
+#include "resolve.h"
+#include "arena.h"
+#include "certstore.h"
+#include "chainwalk.h"
+#include "helper.h"
+#include "keyset.h"
+#include "pktindex.h"
+#include "tcppool.h"
+#include "upstream.h"
+#include "zone.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <libgen.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <time.h>
+
+#include <ldns/ldns.h>
+
+#define MAXBUF 1024
+#define THREADS 16
+#define LOCALHOST "127.0.0.1"
+
+int verbosity = -1;
+
+/*
+ * Replays a query log through the validation pipeline (query, verify_rr,
+ * verify_trust, check_trustedkeys). Queries are scheduled open loop: each
+ * one has an intended start time taken from the log, scaled, or from a
+ * fixed rate, and its corrected latency is measured from that time, so a
+ * stalled pipeline shows up in the tail instead of silently lowering the
+ * offered load (coordinated omission).
+ */
+struct logentry {
+	double offset;
+	ldns_rdf* name;
+	ldns_rr_type type;
+};
+
+struct loadgen {
+	struct logentry* entries;
+	size_t count;
+	char* serv;
+	int port;
+	uint8_t fam;
+	struct keyset* anchors;
+	int lazy;
+	int64_t start;
+	atomic_size_t next;
+	atomic_size_t validated;
+	int64_t* service;
+	int64_t* corrected;
+	int64_t* finished;
+};
+
+static int
+usage(FILE *fp, char *prog) {
+	fprintf(fp, "%s [options] -f <query log>\n", prog);
+	fprintf(fp, "  replay a query log through DNSSEC validation and report latency\n");
+	fprintf(fp, "  log lines are <seconds> <name> <rrtype>\n");
+	fprintf(fp, "OPTIONS:\n");
+	fprintf(fp, "-4\t\tonly use IPv4\n");
+	fprintf(fp, "-6\t\tonly use IPv6\n");
+	fprintf(fp, "-speed <factor>\t\tReplay at factor times the logged rate (default 1)\n");
+	fprintf(fp, "-qps <rate>\t\tIgnore log times and send at a fixed rate\n");
+	fprintf(fp, "-threads <count>\t\tQueries in flight at most (default %d)\n", THREADS);
+	fprintf(fp, "-zones <zonefile>[,<zonefile>...]\t\tServe these zones locally and trust their top DNSKEYs\n");
+	fprintf(fp, "-keys <directory>\t\tPrivate keys and includes for -zones (default <zone directory>/keys)\n");
+	fprintf(fp, "-lazy\t\tWalk the chain only up to the first trusted key\n");
+	fprintf(fp, "-a <keyfile>\t\tAdd DNSKEY or DS records in the file to trusted keys\n");
+	fprintf(fp, "-preload\t\tLoad all database keys at startup and keep them refreshed\n");
+	fprintf(fp, "-v <verbosity>\t\tVerbosity level [-1-5]\n");
+	fprintf(fp, "@<nameserver>[,<nameserver>...]\t\tUse these nameservers\n");
+	return 0;
+}
+
+static int64_t
+now_us(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void
+sleep_until(int64_t when) {
+	int64_t wait = when - now_us();
+	if (wait <= 0)
+		return;
+	struct timespec ts = { wait / 1000000, (wait % 1000000) * 1000 };
+	nanosleep(&ts, NULL);
+}
+
+static int
+read_log(char* filename, struct logentry** entries, size_t* count) {
+	FILE* file = fopen(filename, "r");
+	if (!file) {
+		fprintf(stderr, "Couldn't open query log %s\n", filename);
+		return LDNS_STATUS_FILE_ERR;
+	}
+
+	size_t capacity = 1024;
+	*count = 0;
+	*entries = malloc(capacity * sizeof(struct logentry));
+	char line[MAXBUF];
+	int line_nr = 0;
+	while (*entries && fgets(line, sizeof(line), file) != NULL) {
+		line_nr++;
+		double offset;
+		char name[MAXBUF];
+		char type[32];
+		if (line[0] == '#' || line[0] == '\n')
+			continue;
+		if (sscanf(line, "%lf %1023s %31s", &offset, name, type) != 3) {
+			fprintf(stderr, "Skipping malformed log line %d\n", line_nr);
+			continue;
+		}
+		ldns_rr_type rtype = ldns_get_rr_type_by_name(type);
+		ldns_rdf* rdf = ldns_dname_new_frm_str(name);
+		if (rtype == 0 || !rdf) {
+			fprintf(stderr, "Skipping bad name or type on log line %d\n",
+					line_nr);
+			ldns_rdf_deep_free(rdf);
+			continue;
+		}
+
+		if (*count == capacity) {
+			capacity *= 2;
+			struct logentry* grown =
+				realloc(*entries, capacity * sizeof(struct logentry));
+			if (!grown) {
+				ldns_rdf_deep_free(rdf);
+				break;
+			}
+			*entries = grown;
+		}
+		(*entries)[*count].offset = offset;
+		(*entries)[*count].name = rdf;
+		(*entries)[*count].type = rtype;
+		(*count)++;
+	}
+	fclose(file);
+	if (!*entries)
+		return LDNS_STATUS_MEM_ERR;
+	return LDNS_STATUS_OK;
+}
+
+// Intended start times in microseconds from the start of the run
+static void
+schedule(struct logentry* entries, size_t count, double speed, double qps) {
+	double first = count > 0 ? entries[0].offset : 0;
+	for (size_t i = 0; i < count; i++) {
+		if (qps > 0)
+			entries[i].offset = i * 1000000.0 / qps;
+		else
+			entries[i].offset = (entries[i].offset - first) * 1000000.0 / speed;
+	}
+}
+
+static int
+add_anchors(struct keyset* anchors, char* filename) {
+	FILE* file = fopen(filename, "r");
+	if (!file) {
+		fprintf(stderr, "Couldn't open key file %s\n", filename);
+		return LDNS_STATUS_FILE_ERR;
+	}
+	int line_nr = 0;
+	while (!feof(file)) {
+		ldns_rr* rr;
+		int result = ldns_rr_new_frm_fp_l(&rr, file, NULL, NULL, NULL,
+										  &line_nr);
+		if (result == LDNS_STATUS_OK)
+			addto_trustedkeys(anchors, rr);
+	}
+	fclose(file);
+	return LDNS_STATUS_OK;
+}
+
+// Trust the DNSKEYs of the topmost zone, normally the root
+static void
+add_zone_anchors(struct keyset* anchors, ldns_rr_list* dnskeys) {
+	size_t top = SIZE_MAX;
+	for (size_t i = 0; i < ldns_rr_list_rr_count(dnskeys); i++) {
+		size_t labels =
+			ldns_dname_label_count(ldns_rr_owner(ldns_rr_list_rr(dnskeys, i)));
+		if (labels < top)
+			top = labels;
+	}
+	for (size_t i = 0; i < ldns_rr_list_rr_count(dnskeys); i++) {
+		ldns_rr* rr = ldns_rr_list_rr(dnskeys, i);
+		if (ldns_dname_label_count(ldns_rr_owner(rr)) == top)
+			addto_trustedkeys(anchors, ldns_rr_clone(rr));
+	}
+}
+
+static int
+validate(struct loadgen* gen, ldns_resolver* res, struct logentry* entry) {
+	ldns_pkt* pkt;
+	query(&pkt, res, entry->name, entry->type);
+	if (!pkt)
+		return LDNS_STATUS_NETWORK_ERR;
+
+	struct pktindex index;
+	pktindex_build(&index, pkt);
+	struct rrgroup* answer =
+		pktindex_find(&index, LDNS_SECTION_ANSWER, NULL, entry->type);
+	int result = LDNS_STATUS_CRYPTO_NO_RRSIG;
+	if (answer && ldns_rr_list_rr_count(answer->sigs) > 0) {
+		// Keys are looked up for the zone that signed the answer
+		char* signer = ldns_rdf2str(
+			ldns_rr_rrsig_signame(ldns_rr_list_rr(answer->sigs, 0)));
+		result = verify_rr(answer->rrs, answer->sigs, signer, entry->type);
+		free(signer);
+	}
+	if (result == LDNS_STATUS_OK && gen->lazy) {
+		result = chainwalk_verify(res, answer->rrs, answer->sigs, gen->anchors);
+	} else if (result == LDNS_STATUS_OK) {
+		ldns_dnssec_data_chain* chain = NULL;
+		ldns_dnssec_trust_tree* tree = NULL;
+		result = verify_trust(&chain, &tree, res, answer->rrs, pkt);
+		if (result == LDNS_STATUS_OK)
+			result = check_trustedkeys(tree, gen->anchors);
+		ldns_dnssec_trust_tree_free(tree);
+		if (chain)
+			ldns_dnssec_data_chain_deep_free(chain);
+	}
+
+	pktindex_free(&index);
+	ldns_pkt_free(pkt);
+	arena_reset(arena_thread());
+	return result;
+}
+
+static void*
+worker(void* arg) {
+	struct loadgen* gen = arg;
+	ldns_resolver* res;
+	if (create_resolver(&res, gen->serv) != LDNS_STATUS_OK) {
+		fprintf(stderr, "Couldn't create resolver\n");
+		return NULL;
+	}
+	ldns_resolver_set_dnssec(res, true);
+	ldns_resolver_set_dnssec_cd(res, true);
+	ldns_resolver_set_ip6(res, gen->fam);
+	if (gen->port)
+		ldns_resolver_set_port(res, gen->port);
+
+	for (;;) {
+		size_t i = atomic_fetch_add(&gen->next, 1);
+		if (i >= gen->count)
+			break;
+		int64_t intended = gen->start + (int64_t) gen->entries[i].offset;
+		sleep_until(intended);
+
+		int64_t begin = now_us();
+		int result = validate(gen, res, &gen->entries[i]);
+		int64_t end = now_us();
+
+		gen->service[i] = end - begin;
+		gen->corrected[i] = end - intended;
+		gen->finished[i] = end;
+		if (result == LDNS_STATUS_OK)
+			atomic_fetch_add(&gen->validated, 1);
+		else if (verbosity >= 1)
+			fprintf(stderr, "Query %zu failed: %s\n", i,
+					ldns_get_errorstr_by_id(result));
+	}
+	ldns_resolver_deep_free(res);
+	arena_thread_free();
+	return NULL;
+}
+
+static int
+compare_latency(const void* a, const void* b) {
+	int64_t x = *(const int64_t*) a;
+	int64_t y = *(const int64_t*) b;
+	return (x > y) - (x < y);
+}
+
+static void
+print_percentiles(char* label, int64_t* latency, size_t count) {
+	static const double percentiles[] = { 0.5, 0.9, 0.99, 0.999 };
+	qsort(latency, count, sizeof(int64_t), compare_latency);
+	printf("%-12s", label);
+	for (size_t i = 0; i < sizeof(percentiles) / sizeof(percentiles[0]); i++) {
+		size_t rank = (size_t) (percentiles[i] * count + 0.999999);
+		size_t index = rank > 0 ? rank - 1 : 0;
+		printf("%10.3f", latency[index] / 1000.0);
+	}
+	printf("%10.3f\n", latency[count - 1] / 1000.0);
+}
+
+static void
+report(struct loadgen* gen) {
+	if (gen->count == 0) {
+		printf("No queries in log\n");
+		return;
+	}
+	int64_t last = gen->start;
+	for (size_t i = 0; i < gen->count; i++) {
+		if (gen->finished[i] > last)
+			last = gen->finished[i];
+	}
+	double elapsed = (last - gen->start) / 1000000.0;
+	double span = gen->entries[gen->count - 1].offset / 1000000.0;
+	size_t validated = atomic_load(&gen->validated);
+
+	printf("Queries:     %zu (%zu validated, %zu failed)\n", gen->count,
+		   validated, gen->count - validated);
+	printf("Duration:    %.3f s\n", elapsed);
+	if (span > 0)
+		printf("Offered:     %.1f qps\n", gen->count / span);
+	if (elapsed > 0)
+		printf("Throughput:  %.1f qps\n", gen->count / elapsed);
+	printf("\n%-12s%10s%10s%10s%10s%10s\n", "Latency (ms)", "p50", "p90",
+		   "p99", "p99.9", "max");
+	print_percentiles("service", gen->service, gen->count);
+	print_percentiles("corrected", gen->corrected, gen->count);
+}
+
+int
+main(int argc, char *argv[]) {
+	int result = LDNS_STATUS_OK;
+	char *arg_end_ptr = NULL;
+	char* logfile = NULL;
+	char* zones = NULL;
+	char* keydir = NULL;
+	int preload = 0;
+	int threads = THREADS;
+	double speed = 1;
+	double qps = 0;
+	struct zone_server* server = NULL;
+
+	struct loadgen gen;
+	memset(&gen, 0, sizeof(gen));
+	gen.fam = LDNS_RESOLV_INETANY;
+	gen.anchors = keyset_new();
+
+	if (argc < 2) {
+		usage(stdout, argv[0]);
+		exit(EXIT_FAILURE);
+	}
+	// ldns writes TCP queries without MSG_NOSIGNAL; a peer that hangs up must not kill the run
+	signal(SIGPIPE, SIG_IGN);
+	for (int i = 1; i < argc; i++) {
+		if (strncmp(argv[i], "-4", 3) == 0) {
+			gen.fam = LDNS_RESOLV_INET;
+		} else if (strncmp(argv[i], "-6", 3) == 0) {
+			gen.fam = LDNS_RESOLV_INET6;
+		} else if (strcmp("-preload", argv[i]) == 0) {
+			preload = 1;
+		} else if (strcmp("-lazy", argv[i]) == 0) {
+			gen.lazy = 1;
+		} else if (argv[i][0] == '@') {
+			if (strlen(argv[i]) > 1) {
+				gen.serv = argv[i] + 1;
+			} else if (i + 1 < argc) {
+				gen.serv = argv[++i];
+			} else {
+				printf("Missing argument for @\n");
+				exit(1);
+			}
+		} else if (i + 1 >= argc) {
+			printf("Missing argument for %s\n", argv[i]);
+			exit(1);
+		} else if (strcmp("-f", argv[i]) == 0) {
+			logfile = argv[++i];
+		} else if (strcmp("-zones", argv[i]) == 0) {
+			zones = argv[++i];
+		} else if (strcmp("-keys", argv[i]) == 0) {
+			keydir = argv[++i];
+		} else if (strcmp("-a", argv[i]) == 0) {
+			if (add_anchors(gen.anchors, argv[++i]) != LDNS_STATUS_OK)
+				exit(1);
+		} else if (strcmp("-speed", argv[i]) == 0) {
+			speed = strtod(argv[i+1], &arg_end_ptr);
+			if (*arg_end_ptr != '\0' || speed <= 0) {
+				printf("Bad argument for -speed: %s\n", argv[i+1]);
+				exit(1);
+			}
+			i++;
+		} else if (strcmp("-qps", argv[i]) == 0) {
+			qps = strtod(argv[i+1], &arg_end_ptr);
+			if (*arg_end_ptr != '\0' || qps <= 0) {
+				printf("Bad argument for -qps: %s\n", argv[i+1]);
+				exit(1);
+			}
+			i++;
+		} else if (strcmp("-threads", argv[i]) == 0) {
+			threads = strtol(argv[i+1], &arg_end_ptr, 10);
+			if (*arg_end_ptr != '\0' || threads <= 0) {
+				printf("Bad argument for -threads: %s\n", argv[i+1]);
+				exit(1);
+			}
+			i++;
+		} else if (strncmp(argv[i], "-v", 3) == 0) {
+			verbosity = strtol(argv[i+1], &arg_end_ptr, 10);
+			if (*arg_end_ptr != '\0') {
+				printf("Bad argument for -v: %s\n", argv[i+1]);
+				exit(1);
+			}
+			i++;
+		} else {
+			usage(stdout, argv[0]);
+			exit(1);
+		}
+	}
+	if (!logfile) {
+		printf("No query log given\n");
+		exit(1);
+	}
+
+	result = read_log(logfile, &gen.entries, &gen.count);
+	if (result != LDNS_STATUS_OK)
+		goto exit;
+	schedule(gen.entries, gen.count, speed, qps);
+
+	if (zones) {
+		char* files[MAXBUF];
+		size_t count = 0;
+		char* saveptr;
+		for (char* z = strtok_r(zones, ",", &saveptr); z != NULL && count < MAXBUF;
+			 z = strtok_r(NULL, ",", &saveptr))
+			files[count++] = z;
+
+		char defaultdir[MAXBUF];
+		if (!keydir) {
+			char* zonedir = strdup(files[0]);
+			snprintf(defaultdir, sizeof(defaultdir), "%s/keys", dirname(zonedir));
+			free(zonedir);
+			keydir = defaultdir;
+		}
+		server = zone_serve_start(files, count, keydir);
+		if (!server) {
+			result = LDNS_STATUS_ERR;
+			goto exit;
+		}
+		// Keys come from the served zones instead of the database
+		certstore_load_keys(zone_serve_dnskeys(server));
+		add_zone_anchors(gen.anchors, zone_serve_dnskeys(server));
+		gen.serv = LOCALHOST;
+		gen.port = zone_serve_port(server);
+	} else if (preload) {
+		result = certstore_start(CONFIG_FILE);
+		if (result != LDNS_STATUS_OK)
+			goto exit;
+	}
+
+	gen.service = calloc(gen.count + 1, sizeof(int64_t));
+	gen.corrected = calloc(gen.count + 1, sizeof(int64_t));
+	gen.finished = calloc(gen.count + 1, sizeof(int64_t));
+	pthread_t* workers = calloc(threads, sizeof(pthread_t));
+	if (!gen.service || !gen.corrected || !gen.finished || !workers) {
+		free(workers);
+		result = LDNS_STATUS_MEM_ERR;
+		goto exit;
+	}
+
+	gen.start = now_us();
+	for (int i = 0; i < threads; i++)
+		pthread_create(&workers[i], NULL, worker, &gen);
+	for (int i = 0; i < threads; i++)
+		pthread_join(workers[i], NULL);
+	free(workers);
+	report(&gen);
+
+ exit:
+	for (size_t i = 0; i < gen.count; i++)
+		ldns_rdf_deep_free(gen.entries[i].name);
+	free(gen.entries);
+	free(gen.service);
+	free(gen.corrected);
+	free(gen.finished);
+	certstore_stop();
+	close_mysql();
+	keyset_free(gen.anchors);
+	tcppool_free();
+	upstream_free();
+	zone_serve_stop(server);
+	arena_thread_free();
+
+	return result;
+}
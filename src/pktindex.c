@@ -0,0 +1,156 @@
+#include "pktindex.h"
+#include "hash.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <ldns/ldns.h>
+
+static uint32_t
+group_hash(ldns_pkt_section section, ldns_rdf* owner, ldns_rr_type type) {
+	uint8_t t[3] = { section, type >> 8, type & 0xff };
+	uint32_t hash = hash_dname(ldns_rdf_data(owner), ldns_rdf_size(owner),
+							   HASH_SEED);
+	return hash_bytes(t, sizeof(t), hash);
+}
+
+// Buckets hold group index + 1, so 0 is empty; collisions probe linearly
+static struct rrgroup*
+group_find(struct pktindex* index, ldns_pkt_section section, ldns_rdf* owner,
+		   ldns_rr_type type, size_t* bucket) {
+	size_t mask = index->bucket_count - 1;
+	size_t b = group_hash(section, owner, type) & mask;
+	for (; index->buckets[b]; b = (b + 1) & mask) {
+		struct rrgroup* group = &index->groups[index->buckets[b] - 1];
+		if (group->section == section && group->type == type &&
+			ldns_dname_compare(group->owner, owner) == 0)
+			return group;
+	}
+	*bucket = b;
+	return NULL;
+}
+
+static struct rrgroup*
+group_for(struct pktindex* index, ldns_pkt_section section, ldns_rdf* owner,
+		  ldns_rr_type type) {
+	size_t b;
+	struct rrgroup* group = group_find(index, section, owner, type, &b);
+	if (group)
+		return group;
+	if (index->count == index->capacity)
+		return NULL;
+
+	group = &index->groups[index->count++];
+	group->owner = owner;
+	group->type = type;
+	group->section = section;
+	group->rrs = ldns_rr_list_new();
+	group->sigs = ldns_rr_list_new();
+	index->buckets[b] = index->count;
+	return group;
+}
+
+// Room for the groups of up to records RRs
+int
+pktindex_init(struct pktindex* index, size_t records) {
+	// At most one group per record; twice as many buckets keeps probes short
+	index->count = 0;
+	index->capacity = records + 1;
+	index->bucket_count = 1;
+	while (index->bucket_count < index->capacity * 2)
+		index->bucket_count <<= 1;
+	index->groups = calloc(index->capacity, sizeof(struct rrgroup));
+	index->buckets = calloc(index->bucket_count, sizeof(size_t));
+	if (!index->groups || !index->buckets) {
+		pktindex_free(index);
+		return LDNS_STATUS_MEM_ERR;
+	}
+	return LDNS_STATUS_OK;
+}
+
+// Adds rr to its RRset, or an RRSIG to the RRset it covers
+int
+pktindex_add(struct pktindex* index, ldns_rr* rr, ldns_pkt_section section) {
+	ldns_rr_type type = ldns_rr_get_type(rr);
+	int sig = type == LDNS_RR_TYPE_RRSIG;
+	if (sig) {
+		if (!ldns_rr_rrsig_typecovered(rr))
+			return LDNS_STATUS_OK;
+		type = ldns_rdf2rr_type(ldns_rr_rrsig_typecovered(rr));
+	}
+	struct rrgroup* group = group_for(index, section, ldns_rr_owner(rr), type);
+	if (!group)
+		return LDNS_STATUS_MEM_ERR;
+	ldns_rr_list_push_rr(sig ? group->sigs : group->rrs, rr);
+	return LDNS_STATUS_OK;
+}
+
+static int
+index_section(struct pktindex* index, ldns_rr_list* rrs,
+			  ldns_pkt_section section) {
+	int result = LDNS_STATUS_OK;
+	for (size_t i = 0; result == LDNS_STATUS_OK &&
+			 i < ldns_rr_list_rr_count(rrs); i++)
+		result = pktindex_add(index, ldns_rr_list_rr(rrs, i), section);
+	return result;
+}
+
+// Group every section of the packet by (owner, type) in a single pass
+int
+pktindex_build(struct pktindex* index, ldns_pkt* pkt) {
+	index->groups = NULL;
+	index->count = 0;
+	index->capacity = 0;
+	index->buckets = NULL;
+	index->bucket_count = 0;
+	if (!pkt)
+		return LDNS_STATUS_OK;
+
+	int result = pktindex_init(index,
+							   ldns_rr_list_rr_count(ldns_pkt_answer(pkt)) +
+							   ldns_rr_list_rr_count(ldns_pkt_authority(pkt)) +
+							   ldns_rr_list_rr_count(ldns_pkt_additional(pkt)));
+	if (result == LDNS_STATUS_OK)
+		result = index_section(index, ldns_pkt_answer(pkt),
+							   LDNS_SECTION_ANSWER);
+	if (result == LDNS_STATUS_OK)
+		result = index_section(index, ldns_pkt_authority(pkt),
+							   LDNS_SECTION_AUTHORITY);
+	if (result == LDNS_STATUS_OK)
+		result = index_section(index, ldns_pkt_additional(pkt),
+							   LDNS_SECTION_ADDITIONAL);
+	return result;
+}
+
+void
+pktindex_free(struct pktindex* index) {
+	for (size_t i = 0; i < index->count; i++) {
+		ldns_rr_list_free(index->groups[i].rrs);
+		ldns_rr_list_free(index->groups[i].sigs);
+	}
+	free(index->groups);
+	free(index->buckets);
+	index->groups = NULL;
+	index->count = 0;
+	index->capacity = 0;
+	index->buckets = NULL;
+	index->bucket_count = 0;
+}
+
+// With no owner, returns the first non-empty RRset of the type in the section
+struct rrgroup*
+pktindex_find(struct pktindex* index, ldns_pkt_section section,
+			  ldns_rdf* owner, ldns_rr_type type) {
+	if (owner) {
+		size_t b;
+		return index->bucket_count ?
+			group_find(index, section, owner, type, &b) : NULL;
+	}
+	for (size_t i = 0; i < index->count; i++) {
+		struct rrgroup* group = &index->groups[i];
+		if (group->section == section && group->type == type &&
+			ldns_rr_list_rr_count(group->rrs) > 0)
+			return group;
+	}
+	return NULL;
+}
@@ -1,4 +1,9 @@
 #include "resolve.h"
+#include "arena.h"
+#include "hedge.h"
+#include "pktindex.h"
+#include "tcppool.h"
+#include "upstream.h"
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -9,12 +14,25 @@
 #define MAXBUF 1024
 #define THREADS 32
 #define RR LDNS_RR_TYPE_A
+// Comma separated upstreams, or NULL for resolv.conf
+#define SERVERS NULL
+// Percent of queries that may be hedged to a second upstream, 0 to disable
+#define HEDGE 0
+// 1 to derive truncation at every EDNS buffer size and time the TCP fallback
+#define SWEEP 0
+#define SWEEP_BUFSIZE 4096
 
 int verbosity = 0;
 
+// 512 stands for a query without EDNS
+static const int sweep_sizes[] = { 512, 1232, 1410, 4096 };
+#define SWEEP_COUNT (sizeof(sweep_sizes) / sizeof(sweep_sizes[0]))
+
 struct rrsig_info {
 	int bytes;
-	int algorithm
+	int algorithm;
+	int truncated[SWEEP_COUNT];
+	int tcp_ms;
 };
 
 struct arg {
@@ -74,30 +92,63 @@ get_dnssec_zones(char** zones, int linecount) {
 	return z;
 }
 
+/*
+ * Time a query over a fresh TCP connection, which is what a client pays
+ * after a truncated UDP answer. The pooled connections used by query()
+ * would hide the handshake.
+ */
+int
+time_tcp_fallback(char* domain_name, ldns_resolver* res) {
+	ldns_rdf* domain = ldns_dname_new_frm_str(domain_name);
+	if (!domain)
+		return -1;
+	bool usevc = ldns_resolver_usevc(res);
+	ldns_resolver_set_usevc(res, true);
+	ldns_pkt* pkt = ldns_resolver_query(res, domain, RR, LDNS_RR_CLASS_IN,
+										LDNS_RD);
+	ldns_resolver_set_usevc(res, usevc);
+
+	int tcp_ms = -1;
+	if (pkt) {
+		tcp_ms = ldns_pkt_querytime(pkt);
+		ldns_pkt_free(pkt);
+	}
+	ldns_rdf_deep_free(domain);
+	return tcp_ms;
+}
+
+// The answer size is known once, so truncation follows for every buffer size
+void
+sweep(char* domain_name, ldns_resolver* res, struct rrsig_info* info) {
+	int needs_tcp = 0;
+	for (size_t i = 0; i < SWEEP_COUNT; i++) {
+		info->truncated[i] = info->bytes > sweep_sizes[i];
+		needs_tcp |= info->truncated[i];
+	}
+	info->tcp_ms = needs_tcp ? time_tcp_fallback(domain_name, res) : -1;
+}
+
 int
 check_dnssec(char* domain_name, ldns_resolver* res, struct rrsig_info* info) {
 	ldns_rdf* domain = ldns_dname_new_frm_str(domain_name);
 	ldns_pkt* pkt;
 	query(&pkt, res, domain, RR);
-	ldns_rr_list* rrset =
-		ldns_pkt_rr_list_by_type(pkt, RR, LDNS_SECTION_ANSWER);
-	if (!rrset || !ldns_rr_list_rr_count(rrset))
-		return 0;
-
-	ldns_rr_list* rrsig =
-		ldns_pkt_rr_list_by_type(pkt, LDNS_RR_TYPE_RRSIG, LDNS_SECTION_ANSWER);
-	if (!rrsig) {
-		ldns_pkt_free(pkt);
-		ldns_rdf_deep_free(domain);
-		return 0;
+	struct pktindex index;
+	pktindex_build(&index, pkt);
+	struct rrgroup* answer =
+		pktindex_find(&index, LDNS_SECTION_ANSWER, NULL, RR);
+
+	int signed_answer = answer && ldns_rr_list_rr_count(answer->sigs);
+	if (signed_answer) {
+		info->bytes = ldns_pkt_size(pkt);
+		info->algorithm = ldns_rdf2native_int8(
+			ldns_rr_rrsig_algorithm(ldns_rr_list_rr(answer->sigs, 0)));
 	}
-	info->bytes = ldns_pkt_size(pkt);
-	info->algorithm = ldns_rdf2native_int8(ldns_rr_rdf(ldns_rr_set_pop_rr(rrsig),1));
 
-	ldns_rr_list_deep_free(rrset);
+	pktindex_free(&index);
 	ldns_pkt_free(pkt);
 	ldns_rdf_deep_free(domain);
-	return 1;
+	return signed_answer;
 }
 
 void*
@@ -110,7 +161,7 @@ request(void* arg) {
 	for(int i = start; i < linecount; i+=THREADS) {
 		// Create resolver
 		ldns_resolver *res;
-		int result = create_resolver(&res, NULL);
+		int result = create_resolver(&res, SERVERS);
 		if (result != EXIT_SUCCESS)
 			continue;
 
@@ -122,13 +173,25 @@ request(void* arg) {
 			result = 2;
 			continue;
 		}
+		if (SWEEP)
+			ldns_resolver_set_edns_udp_size(res, SWEEP_BUFSIZE);
 
 		struct rrsig_info info;
 		if(check_dnssec(zones[i], res, &info)) {
-			printf("%-50s\t\t%d\t\t%d\n", zones[i], info.bytes, info.algorithm);
+			if (SWEEP) {
+				sweep(zones[i], res, &info);
+				printf("%-50s\t\t%d\t\t%d", zones[i], info.bytes, info.algorithm);
+				for (size_t j = 0; j < SWEEP_COUNT; j++)
+					printf("\t\t%d", info.truncated[j]);
+				printf("\t\t%d\n", info.tcp_ms);
+			} else {
+				printf("%-50s\t\t%d\t\t%d\n", zones[i], info.bytes, info.algorithm);
+			}
 		}
 
 		ldns_resolver_deep_free(res);
+		// Nothing allocated for this zone outlives it
+		arena_reset(arena_thread());
 	}
 }
 
@@ -137,10 +200,21 @@ main(void) {
 	int linecount = count_lines();
 	char** zones = malloc(sizeof(char*)*linecount);
 	linecount = get_dnssec_zones(zones, linecount);
-
-	printf("%-50s\t\t%s\t\t%s\n"
-		   "%-50s\t\t-----\t\t---------\n",
-		   "Domain name", "Bytes", "Algorithm", "-----------");
+	hedge_set_budget(HEDGE);
+
+	if (SWEEP) {
+		printf("%-50s\t\t%s\t\t%s", "Domain name", "Bytes", "Algorithm");
+		for (size_t i = 0; i < SWEEP_COUNT; i++)
+			printf("\t\tTC%d", sweep_sizes[i]);
+		printf("\t\tTCP ms\n%-50s\t\t-----\t\t---------", "-----------");
+		for (size_t i = 0; i < SWEEP_COUNT; i++)
+			printf("\t\t------");
+		printf("\t\t------\n");
+	} else {
+		printf("%-50s\t\t%s\t\t%s\n"
+			   "%-50s\t\t-----\t\t---------\n",
+			   "Domain name", "Bytes", "Algorithm", "-----------");
+	}
 
 	struct arg in[THREADS];
 	pthread_t threads[THREADS];
@@ -161,5 +235,7 @@ main(void) {
 		free(zones[i]);
 	}
 	free(zones);
+	tcppool_free();
+	upstream_free();
 	return 0;
 }
@@ -1,15 +1,34 @@
 #include "resolve.h"
+#include "arena.h"
+#include "certstore.h"
+#include "hedge.h"
 #include "helper.h"
+#include "keyset.h"
+#include "sigcache.h"
+#include "singleflight.h"
+#include "tcppool.h"
+#include "upstream.h"
+#include "verify.h"
 
 #include <ldns/ldns.h>
 
-#define CONFIG_FILE "config.conf"
+#include <openssl/evp.h>
+#include <openssl/objects.h>
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+#include <openssl/core_names.h>
+#else
+#include <openssl/ec.h>
+#include <openssl/rsa.h>
+#endif
+
 #define MAXBUF 1024
+#define MAX_CURVE_NAME 64
+#define QUERY_KEY_SIZE 512
 
 extern int verbosity;
 
-int
-create_resolver(ldns_resolver** res, char* serv) {
+static int
+push_nameserver(ldns_resolver* res, char* serv) {
 	ldns_status status;
 
 	ldns_rdf* serv_rdf;
@@ -17,6 +36,59 @@ create_resolver(ldns_resolver** res, char* serv) {
 	ldns_rr_list *cmdline_rr_list;
 	ldns_rdf *cmdline_dname;
 
+	/* add the nameserver */
+	serv_rdf = ldns_rdf_new_frm_str(LDNS_RDF_TYPE_A, serv);
+	if (!serv_rdf) {
+		/* maybe ip6 */
+		serv_rdf = ldns_rdf_new_frm_str(LDNS_RDF_TYPE_AAAA, serv);
+	}
+	if (!serv_rdf) {
+		/* try to resolv the name if possible */
+		status = ldns_resolver_new_frm_file(&cmdline_res, NULL);
+
+		if (status != LDNS_STATUS_OK) {
+			fprintf(stderr, "%s", "@server ip could not be converted");
+			return status;
+		}
+
+		cmdline_dname = ldns_dname_new_frm_str(serv);
+		cmdline_rr_list = ldns_get_rr_list_addr_by_name(cmdline_res,
+														cmdline_dname,
+														LDNS_RR_CLASS_IN,
+														0);
+		ldns_rdf_deep_free(cmdline_dname);
+		ldns_resolver_deep_free(cmdline_res);
+		if (!cmdline_rr_list) {
+			fprintf(stderr, "%s %s", "could not find any address for the name: ", serv);
+			return LDNS_STATUS_ERR;
+		} else {
+			if (ldns_resolver_push_nameserver_rr_list(
+													  res,
+													  cmdline_rr_list
+													  ) != LDNS_STATUS_OK) {
+				fprintf(stderr, "%s", "pushing nameserver");
+				ldns_rr_list_deep_free(cmdline_rr_list);
+				return LDNS_STATUS_ERR;
+			}
+			ldns_rr_list_deep_free(cmdline_rr_list);
+		}
+	} else {
+		if (ldns_resolver_push_nameserver(res, serv_rdf) != LDNS_STATUS_OK) {
+			fprintf(stderr, "%s", "pushing nameserver");
+			return LDNS_STATUS_ERR;
+		} else {
+			ldns_rdf_deep_free(serv_rdf);
+		}
+	}
+	return LDNS_STATUS_OK;
+}
+
+/*
+ * serv may list several upstreams separated by commas. query() reorders
+ * the resolver's nameservers, so each thread needs its own resolver.
+ */
+int
+create_resolver(ldns_resolver** res, char* serv) {
 	if(!serv) {
 		if (ldns_resolver_new_frm_file(res, NULL) != LDNS_STATUS_OK) {
 			fprintf(stderr, "%s", "Could not create resolver obj");
@@ -27,62 +99,149 @@ create_resolver(ldns_resolver** res, char* serv) {
 		if (!(*res) || strlen(serv) <= 0) {
 			return LDNS_STATUS_ERR;
 		}
-		/* add the nameserver */
-		serv_rdf = ldns_rdf_new_frm_str(LDNS_RDF_TYPE_A, serv);
-		if (!serv_rdf) {
-			/* maybe ip6 */
-			serv_rdf = ldns_rdf_new_frm_str(LDNS_RDF_TYPE_AAAA, serv);
-		}
-		if (!serv_rdf) {
-			/* try to resolv the name if possible */
-			status = ldns_resolver_new_frm_file(&cmdline_res, NULL);
-
+		char* servers = strdup(serv);
+		if (!servers)
+			return LDNS_STATUS_MEM_ERR;
+		char* saveptr;
+		for (char* s = strtok_r(servers, ",", &saveptr); s != NULL;
+			 s = strtok_r(NULL, ",", &saveptr)) {
+			int status = push_nameserver(*res, s);
 			if (status != LDNS_STATUS_OK) {
-				fprintf(stderr, "%s", "@server ip could not be converted");
+				free(servers);
 				return status;
 			}
-
-			cmdline_dname = ldns_dname_new_frm_str(serv);
-			cmdline_rr_list = ldns_get_rr_list_addr_by_name(cmdline_res,
-															cmdline_dname,
-															LDNS_RR_CLASS_IN,
-															0);
-			ldns_rdf_deep_free(cmdline_dname);
-			ldns_resolver_deep_free(cmdline_res);
-			if (!cmdline_rr_list) {
-				fprintf(stderr, "%s %s", "could not find any address for the name: ", serv);
-				return LDNS_STATUS_ERR;
-			} else {
-				if (ldns_resolver_push_nameserver_rr_list(
-														  *res,
-														  cmdline_rr_list
-														  ) != LDNS_STATUS_OK) {
-					fprintf(stderr, "%s", "pushing nameserver");
-					ldns_rr_list_deep_free(cmdline_rr_list);
-					return LDNS_STATUS_ERR;
-				}
-				ldns_rr_list_deep_free(cmdline_rr_list);
-			}
-		} else {
-			if (ldns_resolver_push_nameserver(*res, serv_rdf) != LDNS_STATUS_OK) {
-				fprintf(stderr, "%s", "pushing nameserver");
-				return LDNS_STATUS_ERR;
-			} else {
-				ldns_rdf_deep_free(serv_rdf);
-			}
 		}
+		free(servers);
 	}
 	return LDNS_STATUS_OK;
 }
 
+static void*
+pkt_copy(const void* pkt) {
+	return ldns_pkt_clone((ldns_pkt*) pkt);
+}
+
+static void
+pkt_free(void* pkt) {
+	ldns_pkt_free(pkt);
+}
+
+// Concurrent identical queries share one upstream query, see query_key
+static struct singleflight inflight_queries =
+	SINGLEFLIGHT_INIT(pkt_copy, pkt_free);
+
+static void
+send_query(ldns_pkt** p, ldns_resolver* res, ldns_rdf* domain,
+		   ldns_rr_type type) {
+	*p = NULL;
+	ldns_rdf* server = upstream_select(res);
+	bool hedged = false;
+	bool timed_out = false;
+	if (tcppool_prefer(type) || ldns_resolver_usevc(res)) {
+		tcppool_query(p, res, domain, type);
+	} else if (hedge_enabled()) {
+		// hedge_query reports the RTT of whichever upstream answered. After
+		// a timeout it has already spent the resolver timeout on two
+		// upstreams, and another full attempt would double the tail; when
+		// the sockets merely failed, ldns still tries the other servers.
+		int status = hedge_query(p, res, domain, type);
+		hedged = status == LDNS_STATUS_OK;
+		timed_out = status == LDNS_STATUS_NETWORK_ERR;
+	}
+
+	if (!(*p) && !timed_out) {
+		// Truncated answers are retried below over a pooled connection
+		// instead of a fresh TCP connection per query
+		bool fallback = ldns_resolver_fallback(res);
+		ldns_resolver_set_fallback(res, false);
+		*p = ldns_resolver_query(res, domain, type, LDNS_RR_CLASS_IN, LDNS_RD);
+		ldns_resolver_set_fallback(res, fallback);
+	}
+	if (*p && ldns_pkt_tc(*p)) {
+		ldns_pkt* tcp_pkt;
+		if (tcppool_query(&tcp_pkt, res, domain, type) == LDNS_STATUS_OK) {
+			ldns_pkt_free(*p);
+			*p = tcp_pkt;
+		}
+	}
+	if (!hedged)
+		upstream_report(server, *p);
+}
+
+static int
+rdf_order(const void* a, const void* b) {
+	return ldns_rdf_compare(*(ldns_rdf* const*) a, *(ldns_rdf* const*) b);
+}
+
+// Coalescing key: the name in canonical case, the type and everything about
+// the resolver that changes the answer (nameserver set, port, DO/CD,
+// transport). upstream_select reorders the nameservers on every query, so
+// they go in sorted to let threads with the same set share a flight.
+static ldns_buffer*
+query_key(ldns_resolver* res, ldns_rdf* domain, ldns_rr_type type) {
+	size_t count = ldns_resolver_nameserver_count(res);
+	ldns_rdf** servers = malloc((count + 1) * sizeof(ldns_rdf*));
+	ldns_buffer* key = servers ? ldns_buffer_new(QUERY_KEY_SIZE) : NULL;
+	if (!key) {
+		free(servers);
+		return NULL;
+	}
+	memcpy(servers, ldns_resolver_nameservers(res), count * sizeof(ldns_rdf*));
+	qsort(servers, count, sizeof(ldns_rdf*), rdf_order);
+
+	bool ok = ldns_rdf2buffer_wire_canonical(key, domain) == LDNS_STATUS_OK &&
+		ldns_buffer_reserve(key, 5);
+	if (ok) {
+		ldns_buffer_write_u16(key, type);
+		ldns_buffer_write_u16(key, ldns_resolver_port(res));
+		ldns_buffer_write_u8(key, (ldns_resolver_dnssec(res) ? 1 : 0) |
+							 (ldns_resolver_dnssec_cd(res) ? 2 : 0) |
+							 (ldns_resolver_usevc(res) ? 4 : 0));
+	}
+	for (size_t i = 0; ok && i < count; i++) {
+		// A and AAAA rdata have fixed sizes, so the type keeps the list unambiguous
+		ok = ldns_buffer_reserve(key, 1);
+		if (ok) {
+			ldns_buffer_write_u8(key, ldns_rdf_get_type(servers[i]));
+			ok = ldns_rdf2buffer_wire(key, servers[i]) == LDNS_STATUS_OK;
+		}
+	}
+	free(servers);
+	if (!ok) {
+		ldns_buffer_free(key);
+		return NULL;
+	}
+	return key;
+}
+
 int
-query(ldns_pkt** p, ldns_resolver* res, char* domain, ldns_rr_type type) {
+query(ldns_pkt** p, ldns_resolver* res, ldns_rdf* domain, ldns_rr_type type) {
 	if (verbosity >= 2) {
 		printf("\nQuerying for: ");
 		ldns_rdf_print(stdout, domain);
 		printf("\n");
 	}
-	*p = ldns_resolver_query(res, domain, type, LDNS_RR_CLASS_IN, LDNS_RD);
+	ldns_buffer* key = query_key(res, domain, type);
+	if (!key) {
+		send_query(p, res, domain, type);
+		return LDNS_STATUS_OK;
+	}
+
+	int leader;
+	struct flight* flight =
+		singleflight_join(&inflight_queries, ldns_buffer_begin(key),
+						  ldns_buffer_position(key), &leader);
+	ldns_buffer_free(key);
+	if (leader) {
+		send_query(p, res, domain, type);
+		singleflight_done(&inflight_queries, flight, LDNS_STATUS_OK, *p);
+	} else {
+		const void* shared;
+		singleflight_wait(&inflight_queries, flight, &shared);
+		*p = singleflight_take(&inflight_queries, flight);
+		if (verbosity >= 2)
+			printf("Shared answer of a concurrent query\n");
+	}
 	if (verbosity >= 3) {
 		if (*p) {
 			ldns_pkt_print(stdout, *p);
@@ -93,10 +252,180 @@ query(ldns_pkt** p, ldns_resolver* res, char* domain, ldns_rr_type type) {
 	return LDNS_STATUS_OK;
 }
 
+// NID of an EC key's named curve, or NID_undef
+static int
+ec_curve_nid(EVP_PKEY* pkey) {
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+	char name[MAX_CURVE_NAME];
+	if (EVP_PKEY_get_group_name(pkey, name, sizeof(name), NULL) != 1)
+		return NID_undef;
+	return OBJ_txt2nid(name);
+#else
+	const EC_KEY* ec = EVP_PKEY_get0_EC_KEY(pkey);
+	const EC_GROUP* group = ec ? EC_KEY_get0_group(ec) : NULL;
+	return group ? EC_GROUP_get_curve_name(group) : NID_undef;
+#endif
+}
+
+// Copies of an RSA key's modulus and public exponent, freed by the caller
+static int
+rsa_key(EVP_PKEY* pkey, BIGNUM** n, BIGNUM** e) {
+	*n = NULL;
+	*e = NULL;
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+	EVP_PKEY_get_bn_param(pkey, OSSL_PKEY_PARAM_RSA_N, n);
+	EVP_PKEY_get_bn_param(pkey, OSSL_PKEY_PARAM_RSA_E, e);
+#else
+	const BIGNUM* rsa_n;
+	const BIGNUM* rsa_e;
+	const RSA* rsa = EVP_PKEY_get0_RSA(pkey);
+	if (rsa) {
+		RSA_get0_key(rsa, &rsa_n, &rsa_e, NULL);
+		*n = BN_dup(rsa_n);
+		*e = BN_dup(rsa_e);
+	}
+#endif
+	if (!*n || !*e) {
+		BN_free(*n);
+		BN_free(*e);
+		return LDNS_STATUS_SSL_ERR;
+	}
+	return LDNS_STATUS_OK;
+}
+
+/*
+ * Build the DNSKEY algorithm and public key field (RFC 6605, RFC 8080,
+ * RFC 3110) from a certificate's public key.
+ */
+static int
+pubkey_to_dnskey(EVP_PKEY* pkey, uint8_t* algorithm, uint8_t** key,
+				 size_t* key_len) {
+	struct arena* arena = arena_thread();
+	int type = EVP_PKEY_base_id(pkey);
+
+	if (type == EVP_PKEY_ED25519 || type == EVP_PKEY_ED448) {
+		*algorithm = type == EVP_PKEY_ED25519 ? ALG_ED25519 : ALG_ED448;
+		if (EVP_PKEY_get_raw_public_key(pkey, NULL, key_len) != 1)
+			return LDNS_STATUS_SSL_ERR;
+		*key = arena_alloc(arena, *key_len);
+		if (!*key)
+			return LDNS_STATUS_MEM_ERR;
+		if (EVP_PKEY_get_raw_public_key(pkey, *key, key_len) != 1)
+			return LDNS_STATUS_SSL_ERR;
+		return LDNS_STATUS_OK;
+	}
+
+	if (type == EVP_PKEY_EC) {
+		// Only P-256 and P-384 have DNSSEC algorithms; other curves of the
+		// same size, e.g. secp256k1, must not be published as either
+		int nid = ec_curve_nid(pkey);
+		int bits;
+		if (nid == NID_X9_62_prime256v1) {
+			*algorithm = ALG_ECDSAP256SHA256;
+			bits = 256;
+		} else if (nid == NID_secp384r1) {
+			*algorithm = ALG_ECDSAP384SHA384;
+			bits = 384;
+		} else {
+			return LDNS_STATUS_CRYPTO_UNKNOWN_ALGO;
+		}
+
+		// The DER SubjectPublicKeyInfo ends in the uncompressed point; the
+		// DNSKEY field is that point without its leading 0x04
+		unsigned char* der = NULL;
+		int der_len = i2d_PUBKEY(pkey, &der);
+		*key_len = 2 * (bits / 8);
+		if (der_len < (int) *key_len) {
+			OPENSSL_free(der);
+			return LDNS_STATUS_SSL_ERR;
+		}
+		*key = arena_alloc(arena, *key_len);
+		if (*key)
+			memcpy(*key, der + der_len - *key_len, *key_len);
+		OPENSSL_free(der);
+		return *key ? LDNS_STATUS_OK : LDNS_STATUS_MEM_ERR;
+	}
+
+	if (type == EVP_PKEY_RSA) {
+		BIGNUM* n;
+		BIGNUM* e;
+		if (rsa_key(pkey, &n, &e) != LDNS_STATUS_OK)
+			return LDNS_STATUS_SSL_ERR;
+		int n_len = BN_num_bytes(n);
+		int e_len = BN_num_bytes(e);
+		int hdr_len = e_len > 255 ? 3 : 1;
+
+		*algorithm = ALG_RSASHA256;
+		*key_len = hdr_len + e_len + n_len;
+		*key = arena_alloc(arena, *key_len);
+		if (!*key) {
+			BN_free(n);
+			BN_free(e);
+			return LDNS_STATUS_MEM_ERR;
+		}
+		if (hdr_len == 1) {
+			(*key)[0] = e_len;
+		} else {
+			(*key)[0] = 0;
+			(*key)[1] = (e_len >> 8) & 0xff;
+			(*key)[2] = e_len & 0xff;
+		}
+		BN_bn2bin(e, *key + hdr_len);
+		BN_bn2bin(n, *key + hdr_len + e_len);
+		BN_free(n);
+		BN_free(e);
+		return LDNS_STATUS_OK;
+	}
+	return LDNS_STATUS_CRYPTO_UNKNOWN_ALGO;
+}
+
+/*
+ * The dnskey column holds the algorithm octet and the public key field.
+ * Rows written before the algorithm octet was added hold a bare P-256 key;
+ * the lengths below never match those, so they fall back to the cert.
+ */
+static int
+dnskey_column_valid(const uint8_t* dnskey, size_t len) {
+	switch (dnskey[0]) {
+	case ALG_ECDSAP256SHA256:
+		return len == 1 + 64;
+	case ALG_ECDSAP384SHA384:
+		return len == 1 + 96;
+	case ALG_ED25519:
+		return len == 1 + 32;
+	case ALG_ED448:
+		return len == 1 + 57;
+	case ALG_RSASHA256: {
+		// RFC 3110 exponent length and exponent, then at least a 512 bit modulus
+		if (len < 4)
+			return 0;
+		size_t hdr_len = dnskey[1] ? 1 : 3;
+		size_t e_len = dnskey[1] ? dnskey[1] : (dnskey[2] << 8) | dnskey[3];
+		return e_len > 0 && len >= 1 + hdr_len + e_len + 64;
+	}
+	default:
+		return 0;
+	}
+}
+
 int
-get_key(char** keystr, char* keynamestr, int ksk) {
-	char* cert;
-	int result = get_mysql_cert(CONFIG_FILE, keynamestr, &cert, ksk);
+get_key(char** keystr, uint8_t* algorithm, char* keynamestr, int ksk) {
+	struct certrecord record;
+	*keystr = NULL;
+	int result;
+	if (certstore_loaded())
+		result = certstore_get_cert(keynamestr, ksk, &record);
+	else
+		result = get_mysql_cert(CONFIG_FILE, keynamestr, &record, ksk);
+	int precomputed = result == LDNS_STATUS_OK && record.dnskey_len >= 2 &&
+		dnskey_column_valid(record.dnskey, record.dnskey_len);
+	if (result == LDNS_STATUS_OK && record.dnskey_len > 0 && !precomputed &&
+		verbosity >= 1)
+		fprintf(stderr, "Ignoring dnskey column of %s %s in an old format; "
+				"rerun util/gen_dnskey_column.sh\n", keynamestr,
+				ksk ? "KSK" : "ZSK");
+	if (result == LDNS_STATUS_OK && !record.cert && !precomputed)
+		result = LDNS_STATUS_ERR;
 	if (result != LDNS_STATUS_OK) {
 		if (verbosity >= 2)
 			printf("Failed to get certificate %s %s from the database: %u\n",
@@ -104,71 +433,102 @@ get_key(char** keystr, char* keynamestr, int ksk) {
 		return result;
 	}
 
-	// Convert MYSQL query to X509
-	BIO* cert_bio = BIO_new(BIO_s_mem());
-	BIO_write(cert_bio, cert, strlen(cert));
-	X509* certX509 = PEM_read_bio_X509(cert_bio, NULL, NULL, NULL);
-	free(cert);
-	if (!certX509) {
-		fprintf(stderr, "Failed to parse certificate in memory\n");
-		return LDNS_STATUS_SSL_ERR;
-	}
+	uint8_t* key;
+	size_t key_len;
+	if (precomputed) {
+		// Precomputed algorithm octet and public key; no certificate parsing
+		*algorithm = record.dnskey[0];
+		key = record.dnskey + 1;
+		key_len = record.dnskey_len - 1;
+	} else {
+		// Convert MYSQL query to X509
+		BIO* cert_bio = BIO_new(BIO_s_mem());
+		BIO_write(cert_bio, record.cert, strlen(record.cert));
+		X509* certX509 = PEM_read_bio_X509(cert_bio, NULL, NULL, NULL);
+		BIO_free(cert_bio);
+		if (!certX509) {
+			fprintf(stderr, "Failed to parse certificate in memory\n");
+			return LDNS_STATUS_SSL_ERR;
+		}
 
-	// Get public key from certificate
-	EVP_PKEY* pkey = X509_get_pubkey(certX509);
-	X509_free(certX509);
-	BIO_free(cert_bio);
-	if (!pkey) {
-		fprintf(stderr, "Failed to extract public key from certificate\n");
-		return LDNS_STATUS_SSL_ERR;
+		// Get public key from certificate
+		EVP_PKEY* pkey = X509_get_pubkey(certX509);
+		X509_free(certX509);
+		if (!pkey) {
+			fprintf(stderr, "Failed to extract public key from certificate\n");
+			return LDNS_STATUS_SSL_ERR;
+		}
+
+		result = pubkey_to_dnskey(pkey, algorithm, &key, &key_len);
+		EVP_PKEY_free(pkey);
+		if (result != LDNS_STATUS_OK) {
+			fprintf(stderr, "Unsupported public key in certificate for %s\n",
+					keynamestr);
+			return result;
+		}
 	}
 
 	// Convert public key to base64 encoding
-	BIO* key_bio = BIO_new(BIO_s_mem());
-	PEM_write_bio_PUBKEY(key_bio, pkey);
-	char* p;
-	int read_size = (int) BIO_get_mem_data(key_bio, &p);
-	EVP_PKEY_free(pkey);
-	if (read_size < 1 || !p) {
-		BIO_free(key_bio);
-		fprintf(stderr, "Failed to read public key\n");
-		return LDNS_STATUS_SSL_ERR;
+	size_t len = ldns_b64_ntop_calculate_size(key_len);
+	*keystr = arena_alloc(arena_thread(), len);
+	if (!*keystr)
+		return LDNS_STATUS_MEM_ERR;
+	if (ldns_b64_ntop(key, key_len, *keystr, len) < 0) {
+		fprintf(stderr, "Failed to encode public key\n");
+		*keystr = NULL;
+		return LDNS_STATUS_INVALID_B64;
 	}
+	return LDNS_STATUS_OK;
+}
 
-	// Copy public key
-	const char* KEY_START = "-----BEGIN PUBLIC KEY-----\n";
-	const char* KEY_END = "-----END PUBLIC KEY-----";
-	char* start = strstr(p, KEY_START);
-	char* end = strstr(p, KEY_END);
-	if (start && end) {
-		start += strlen(KEY_START);
-		*keystr = malloc(end-start+1);
-		char* nl;
-		char* keystart = *keystr;
-		while ((nl = strstr(start, "\n")) < end) {
-			memcpy(keystart, start, nl-start);
-			keystart += nl-start;
-			start = nl+1;
-		}
-		*keystart = '\0';
-		result = LDNS_STATUS_OK;
-	} else {
-		fprintf(stderr, "Failed to extract base64 from labels\n");
-		result = LDNS_STATUS_INVALID_B64;
+/*
+ * ldns builds the data chain with its own transport. It looks in the packet
+ * before querying, so the signer's DNSKEY RRset, the large answer, is
+ * fetched over the TCP pool and added to a copy of the packet. The DS
+ * RRsets and the DNSKEYs of the zones above are still fetched by ldns;
+ * chainwalk_verify uses the pool for every level.
+ */
+static ldns_pkt*
+prefetch_dnskeys(ldns_resolver* res, ldns_rr_list* rrlist, ldns_pkt* pkt) {
+	if (!rrlist || ldns_rr_list_rr_count(rrlist) == 0)
+		return NULL;
+	ldns_rr* rr = ldns_rr_list_rr(rrlist, 0);
+	ldns_rr_list* sigs = ldns_dnssec_pkt_get_rrsigs_for_name_and_type(
+		pkt, ldns_rr_owner(rr), ldns_rr_get_type(rr));
+	ldns_rdf* signer = sigs ?
+		ldns_rr_rrsig_signame(ldns_rr_list_rr(sigs, 0)) : NULL;
+	ldns_rr_list* keys = signer ? ldns_pkt_rr_list_by_name_and_type(
+		pkt, signer, LDNS_RR_TYPE_DNSKEY, LDNS_SECTION_ANY_NOQUESTION) : NULL;
+
+	ldns_pkt* copy = NULL;
+	ldns_pkt* keypkt = NULL;
+	if (signer && !keys)
+		query(&keypkt, res, signer, LDNS_RR_TYPE_DNSKEY);
+	if (keypkt) {
+		copy = ldns_pkt_clone(pkt);
+		ldns_rr_list* answer = ldns_pkt_answer(keypkt);
+		for (size_t i = 0; copy && i < ldns_rr_list_rr_count(answer); i++)
+			ldns_pkt_push_rr(copy, LDNS_SECTION_ADDITIONAL,
+							 ldns_rr_clone(ldns_rr_list_rr(answer, i)));
+		ldns_pkt_free(keypkt);
 	}
-	BIO_free(key_bio);
-
-	return result;
+	ldns_rr_list_deep_free(keys);
+	ldns_rr_list_deep_free(sigs);
+	return copy;
 }
 
 int
 verify_trust(ldns_dnssec_data_chain** chain, ldns_dnssec_trust_tree** tree,
 			 ldns_resolver* res, ldns_rr_list* rrlist, ldns_pkt* pkt) {
-	printf(
-		   "\n-------------------------\n"
-		   "Verifying Trust Chain\n"
-		   "-------------------------\n");
-	*chain = ldns_dnssec_build_data_chain(res, NULL, rrlist, pkt, NULL);
+	if (verbosity >= 0)
+		printf(
+			   "\n-------------------------\n"
+			   "Verifying Trust Chain\n"
+			   "-------------------------\n");
+	ldns_pkt* prefetched = prefetch_dnskeys(res, rrlist, pkt);
+	*chain = ldns_dnssec_build_data_chain(res, 0, rrlist,
+										  prefetched ? prefetched : pkt, NULL);
+	ldns_pkt_free(prefetched);
 	if (!(*chain)) {
 		fprintf(stderr, "Couldn't create DNSSEC data chain\n");
 		return LDNS_STATUS_ERR;
@@ -190,14 +550,15 @@ verify_trust(ldns_dnssec_data_chain** chain, ldns_dnssec_trust_tree** tree,
 }
 
 int
-check_trustedkeys(ldns_dnssec_trust_tree* tree, ldns_rr_list* trustedkeys) {
-	printf(
-		   "\n-------------------------\n"
-		   "Verifying Keys Trusted\n"
-		   "-------------------------\n");
-	if (ldns_rr_list_rr_count(trustedkeys) > 0) {
+check_trustedkeys(ldns_dnssec_trust_tree* tree, struct keyset* trustedkeys) {
+	if (verbosity >= 0)
+		printf(
+			   "\n-------------------------\n"
+			   "Verifying Keys Trusted\n"
+			   "-------------------------\n");
+	if (keyset_count(trustedkeys) > 0) {
 		ldns_status tree_result =
-			ldns_dnssec_trust_tree_contains_keys(tree, trustedkeys);
+			keyset_tree_contains_keys(tree, trustedkeys);
 
 		if (tree_result == LDNS_STATUS_DNSSEC_EXISTENCE_DENIED) {
 			if (verbosity >= 0) {
@@ -223,21 +584,20 @@ check_trustedkeys(ldns_dnssec_trust_tree* tree, ldns_rr_list* trustedkeys) {
 
 int
 trustedkey_fromkey(ldns_rr** rr_trustedkey, char* key, char* domain,
-				   int ksk) {
-	char* rr_str;
-	if (ksk)
-		rr_str = " IN DNSKEY 257 3 13 ";
-	else
-		rr_str = " IN DNSKEY 256 3 13 ";
+				   int ksk, uint8_t algorithm) {
+	char rr_str[32];
+	snprintf(rr_str, sizeof(rr_str), " IN DNSKEY %d 3 %u ",
+			 ksk ? 257 : 256, algorithm);
 	int len_dnskey = strlen(key) + strlen(domain) + strlen(rr_str) + 1;
-	const char* dnskey_str = malloc(sizeof(char) * len_dnskey);
+	char* dnskey_str = arena_alloc(arena_thread(), len_dnskey);
+	if (!dnskey_str)
+		return LDNS_STATUS_MEM_ERR;
 	snprintf(dnskey_str, len_dnskey, "%s%s%s", domain, rr_str, key);
 	if (verbosity >= 2) {
 		fprintf(stderr, "\nDNSKEY string: %s\n\n", dnskey_str);
 	}
 
 	int result = ldns_rr_new_frm_str(rr_trustedkey, dnskey_str, 0, NULL, NULL);
-	free(dnskey_str);
 	if (result != LDNS_STATUS_OK) {
 		fprintf(stderr, "Couldn't make trusted DNSKEY record from key: %d\n", result);
 		return result;
@@ -247,32 +607,33 @@ trustedkey_fromkey(ldns_rr** rr_trustedkey, char* key, char* domain,
 }
 
 int
-addto_trustedkeys(ldns_rr_list* rrset_trustedkeys, ldns_rr* rr_trustedkey) {
-	int result = ldns_rr_list_push_rr(rrset_trustedkeys, rr_trustedkey);
-	if (result != true) {
-		fprintf(stderr, "Couldn't push resource record to trusted key set: %d\n", result);
+addto_trustedkeys(struct keyset* rrset_trustedkeys, ldns_rr* rr_trustedkey) {
+	int result = keyset_add(rrset_trustedkeys, rr_trustedkey);
+	if (result != LDNS_STATUS_OK) {
+		fprintf(stderr, "Couldn't add resource record to trusted key set: %d\n", result);
 	}
 	return LDNS_STATUS_OK;
 }
 
 int
-populate_trustedkeys(ldns_rr_list* rrset_trustedkeys, char* domain) {
+populate_trustedkeys(struct keyset* rrset_trustedkeys, char* domain) {
 	int result;
 	char* p = domain;
 	while(p != NULL) {
 		char* key = NULL;
+		uint8_t algorithm;
 		for(int i = 0; i <= 1; i++) {
-			get_key(&key, p, i);
+			get_key(&key, &algorithm, p, i);
 			if (key != NULL) {
 				if (verbosity >= 4)
 					fprintf(stderr, "Key for %s is %s\n", p, key);
 
 				ldns_rr* rr_trustedkey;
-				result = trustedkey_fromkey(&rr_trustedkey, key+36, p, i);
+				result = trustedkey_fromkey(&rr_trustedkey, key, p, i,
+											algorithm);
 				if (result == LDNS_STATUS_OK) {
 					addto_trustedkeys(rrset_trustedkeys, rr_trustedkey);
 				}
-				free(key);
 			}
 		}
 		p = strstr(p+1, ".");
@@ -287,13 +648,15 @@ populate_trustedkeys(ldns_rr_list* rrset_trustedkeys, char* domain) {
 int
 verify_rr(ldns_rr_list* rrset, ldns_rr_list* rrsig, char* domain,
 		  ldns_rr_type rtype) {
-	printf(
-		   "\n-------------------------\n"
-		   "Verifying Resource Record\n"
-		   "-------------------------\n");
+	if (verbosity >= 0)
+		printf(
+			   "\n-------------------------\n"
+			   "Verifying Resource Record\n"
+			   "-------------------------\n");
 
-	if (!rrsig) {
-		printf("No resource record signature; DNSSEC enabled?\n");
+	if (!rrset || !rrsig || ldns_rr_list_rr_count(rrsig) == 0) {
+		if (verbosity >= 0)
+			printf("No resource record signature; DNSSEC enabled?\n");
 		return LDNS_STATUS_CRYPTO_NO_RRSIG;
 	}
 	char* rtype_str;
@@ -318,10 +681,12 @@ verify_rr(ldns_rr_list* rrset, ldns_rr_list* rrsig, char* domain,
 
 	char* zsk;
 	char* ksk;
-	int result = get_key(&zsk, domain, false);
+	uint8_t zsk_algorithm;
+	uint8_t ksk_algorithm;
+	int result = get_key(&zsk, &zsk_algorithm, domain, false);
 	if (result != LDNS_STATUS_OK)
 		zsk = NULL;
-	result = get_key(&ksk, domain, true);
+	result = get_key(&ksk, &ksk_algorithm, domain, true);
 	if (result != LDNS_STATUS_OK)
 		ksk = NULL;
 
@@ -333,17 +698,18 @@ verify_rr(ldns_rr_list* rrset, ldns_rr_list* rrsig, char* domain,
 
 	ldns_rr* trustedzsk = NULL;
 	if (zsk != NULL) {
-		result = trustedkey_fromkey(&trustedzsk, zsk+36, domain, false);
-		free(zsk);
+		result = trustedkey_fromkey(&trustedzsk, zsk, domain, false,
+									zsk_algorithm);
 		if (result != LDNS_STATUS_OK) {
 			return result;
 		}
 	}
 	ldns_rr* trustedksk = NULL;
 	if (ksk) {
-		result = trustedkey_fromkey(&trustedksk, ksk+36, domain, true);
-		free(ksk);
+		result = trustedkey_fromkey(&trustedksk, ksk, domain, true,
+									ksk_algorithm);
 		if (result != LDNS_STATUS_OK) {
+			ldns_rr_free(trustedzsk);
 			return result;
 		}
 	}
@@ -353,9 +719,9 @@ verify_rr(ldns_rr_list* rrset, ldns_rr_list* rrsig, char* domain,
 			printf("\nTrying to verify with zsk...");
 
 		if (trustedzsk) {
-			result = ldns_verify_rrsig(rrset,
-									   ldns_rr_list_rr(rrsig, i),
-									   trustedzsk);
+			result = sigcache_verify_rrsig(rrset,
+										   ldns_rr_list_rr(rrsig, i),
+										   trustedzsk);
 			if (verbosity >= 1) {
 				if (result == LDNS_STATUS_OK)
 					printf("success\n");
@@ -364,7 +730,8 @@ verify_rr(ldns_rr_list* rrset, ldns_rr_list* rrsig, char* domain,
 			}
 		} else {
 			result = LDNS_STATUS_CRYPTO_NO_TRUSTED_DNSKEY;
-			printf("no zsk\n");
+			if (verbosity >= 1)
+				printf("no zsk\n");
 		}
 
 		// Try KSK if ZSK fails
@@ -373,9 +740,9 @@ verify_rr(ldns_rr_list* rrset, ldns_rr_list* rrsig, char* domain,
 				printf("Trying to verify with ksk...");
 
 			if (trustedksk) {
-				result = ldns_verify_rrsig(rrset,
-										   ldns_rr_list_rr(rrsig, i),
-										   trustedksk);
+				result = sigcache_verify_rrsig(rrset,
+											   ldns_rr_list_rr(rrsig, i),
+											   trustedksk);
 				if (verbosity >= 1) {
 					if (result == LDNS_STATUS_OK)
 						printf("success\n");
@@ -384,7 +751,8 @@ verify_rr(ldns_rr_list* rrset, ldns_rr_list* rrsig, char* domain,
 				}
 			} else {
 				result = LDNS_STATUS_CRYPTO_NO_TRUSTED_DNSKEY;
-				printf("no ksk\n");
+				if (verbosity >= 1)
+					printf("no ksk\n");
 			}
 		}
 
@@ -392,5 +760,7 @@ verify_rr(ldns_rr_list* rrset, ldns_rr_list* rrsig, char* domain,
 			printf("Verification result of %s RRSIG for %s: %s\n\n", rtype_str, domain,
 				   ldns_get_errorstr_by_id(result));
 	}
+	ldns_rr_free(trustedzsk);
+	ldns_rr_free(trustedksk);
 	return result;
 }
@@ -0,0 +1,157 @@
+#include "sigcache.h"
+#include "verify.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include <openssl/evp.h>
+#include <openssl/sha.h>
+
+#include <ldns/ldns.h>
+
+#define SIGCACHE_SETS 1024
+#define SIGCACHE_WAYS 4
+#define SIGCACHE_LOCKS 64
+#define SIGCACHE_RR_BUF 512
+
+extern int verbosity;
+
+/*
+ * Bounded cache of signature verification outcomes, keyed by a SHA-256
+ * digest of the canonical RRset, the RRSIG rdata and the DNSKEY. Entries
+ * are valid until the RRSIG expires, so a signature is verified once per
+ * validity window rather than once per query.
+ */
+struct sigcache_entry {
+	int valid;
+	uint8_t digest[SHA256_DIGEST_LENGTH];
+	ldns_status result;
+	time_t expires;
+	time_t used;
+};
+
+static struct sigcache_entry cache[SIGCACHE_SETS][SIGCACHE_WAYS];
+static pthread_mutex_t locks[SIGCACHE_LOCKS];
+static pthread_once_t locks_once = PTHREAD_ONCE_INIT;
+
+static void
+locks_init(void) {
+	for (int i = 0; i < SIGCACHE_LOCKS; i++)
+		pthread_mutex_init(&locks[i], NULL);
+}
+
+static int
+digest_wire(EVP_MD_CTX* ctx, ldns_buffer* buf, ldns_status status) {
+	return status == LDNS_STATUS_OK &&
+		EVP_DigestUpdate(ctx, ldns_buffer_begin(buf),
+						 ldns_buffer_position(buf)) == 1;
+}
+
+static int
+sigcache_digest(ldns_rr_list* rrset, ldns_rr* rrsig, ldns_rr* key,
+				uint8_t* digest) {
+	// One RR at a time, so the buffer only needs to fit the largest RR
+	ldns_buffer* buf = ldns_buffer_new(SIGCACHE_RR_BUF);
+	EVP_MD_CTX* ctx = EVP_MD_CTX_new();
+	int ok = buf && ctx && EVP_DigestInit_ex(ctx, EVP_sha256(), NULL) == 1;
+
+	// Hash the RRset in canonical form so RR order and owner case in the
+	// answer do not produce distinct entries. The TTL counts down behind a
+	// caching upstream; the original TTL is part of the RRSIG rdata already.
+	ldns_rr_list* canonical = ok ? ldns_rr_list_clone(rrset) : NULL;
+	for (size_t i = 0; i < ldns_rr_list_rr_count(canonical); i++) {
+		ldns_rr_set_ttl(ldns_rr_list_rr(canonical, i), 0);
+		ldns_rr2canonical(ldns_rr_list_rr(canonical, i));
+	}
+	if (canonical)
+		ldns_rr_list_sort(canonical);
+
+	for (size_t i = 0; ok && i < ldns_rr_list_rr_count(canonical); i++) {
+		ldns_buffer_clear(buf);
+		ok = digest_wire(ctx, buf,
+						 ldns_rr2buffer_wire(buf, ldns_rr_list_rr(canonical, i),
+											 LDNS_SECTION_ANSWER));
+	}
+	if (ok) {
+		ldns_buffer_clear(buf);
+		ok = digest_wire(ctx, buf, ldns_rr_rdata2buffer_wire(buf, rrsig));
+	}
+	if (ok) {
+		ldns_buffer_clear(buf);
+		ok = digest_wire(ctx, buf, ldns_rr_rdata2buffer_wire(buf, key));
+	}
+	ok = ok && canonical && EVP_DigestFinal_ex(ctx, digest, NULL) == 1;
+
+	ldns_rr_list_deep_free(canonical);
+	EVP_MD_CTX_free(ctx);
+	ldns_buffer_free(buf);
+	return ok;
+}
+
+// Outcomes that depend on the current time are never cached
+static int
+cacheable(ldns_status result) {
+	return result != LDNS_STATUS_CRYPTO_SIG_EXPIRED &&
+		result != LDNS_STATUS_CRYPTO_SIG_NOT_INCEPTED &&
+		result != LDNS_STATUS_MEM_ERR;
+}
+
+ldns_status
+sigcache_verify_rrsig(ldns_rr_list* rrset, ldns_rr* rrsig, ldns_rr* key) {
+	uint8_t digest[EVP_MAX_MD_SIZE];
+	if (!rrset || !rrsig || !key || !ldns_rr_rrsig_expiration(rrsig) ||
+		!sigcache_digest(rrset, rrsig, key, digest))
+		return verify_rrsig_key(rrset, rrsig, key);
+
+	pthread_once(&locks_once, locks_init);
+	uint32_t index;
+	memcpy(&index, digest, sizeof(index));
+	struct sigcache_entry* set = cache[index % SIGCACHE_SETS];
+	pthread_mutex_t* lock = &locks[index % SIGCACHE_LOCKS];
+	time_t now = time(NULL);
+
+	pthread_mutex_lock(lock);
+	for (int i = 0; i < SIGCACHE_WAYS; i++) {
+		if (set[i].valid && set[i].expires > now &&
+			memcmp(set[i].digest, digest, SHA256_DIGEST_LENGTH) == 0) {
+			ldns_status result = set[i].result;
+			set[i].used = now;
+			pthread_mutex_unlock(lock);
+			if (verbosity >= 3)
+				printf("(cached) ");
+			return result;
+		}
+	}
+	pthread_mutex_unlock(lock);
+
+	ldns_status result = verify_rrsig_key(rrset, rrsig, key);
+	if (!cacheable(result))
+		return result;
+
+	time_t expires =
+		ldns_rdf2native_time_t(ldns_rr_rrsig_expiration(rrsig));
+	if (expires <= now)
+		return result;
+
+	// Replace an empty or expired way, else the least recently used
+	pthread_mutex_lock(lock);
+	struct sigcache_entry* victim = &set[0];
+	for (int i = 0; i < SIGCACHE_WAYS; i++) {
+		if (!set[i].valid || set[i].expires <= now) {
+			victim = &set[i];
+			break;
+		}
+		if (set[i].used < victim->used)
+			victim = &set[i];
+	}
+	memcpy(victim->digest, digest, SHA256_DIGEST_LENGTH);
+	victim->result = result;
+	victim->expires = expires;
+	victim->used = now;
+	victim->valid = 1;
+	pthread_mutex_unlock(lock);
+	return result;
+}
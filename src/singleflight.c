@@ -0,0 +1,134 @@
+#include "singleflight.h"
+#include "hash.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include <ldns/ldns.h>
+
+struct flight {
+	void* key;
+	size_t key_len;
+	uint32_t hash;
+	int done;
+	int status;
+	void* value;
+	int refs;
+	pthread_cond_t cond;
+	struct flight* next;
+};
+
+// Called with the group lock held
+static void
+flight_unref(struct singleflight* group, struct flight* flight) {
+	if (--flight->refs > 0)
+		return;
+	if (flight->value && group->free_value)
+		group->free_value(flight->value);
+	pthread_cond_destroy(&flight->cond);
+	free(flight->key);
+	free(flight);
+}
+
+/*
+ * Returns the call for key, with *leader set when the caller has to do the
+ * work and report it with singleflight_done. Waiters call singleflight_wait
+ * and then singleflight_release. If memory runs out the caller leads
+ * without a flight, and done is a no-op.
+ */
+struct flight*
+singleflight_join(struct singleflight* group, const void* key, size_t key_len,
+				  int* leader) {
+	uint32_t hash = hash_bytes(key, key_len, HASH_SEED);
+	pthread_mutex_lock(&group->lock);
+	struct flight** bucket = &group->buckets[hash % SINGLEFLIGHT_BUCKETS];
+	struct flight* flight = *bucket;
+	for (; flight; flight = flight->next) {
+		if (flight->hash == hash && flight->key_len == key_len &&
+			memcmp(flight->key, key, key_len) == 0)
+			break;
+	}
+	if (flight) {
+		flight->refs++;
+		*leader = 0;
+		pthread_mutex_unlock(&group->lock);
+		return flight;
+	}
+
+	*leader = 1;
+	flight = calloc(1, sizeof(struct flight));
+	if (flight)
+		flight->key = malloc(key_len);
+	if (!flight || !flight->key) {
+		free(flight);
+		pthread_mutex_unlock(&group->lock);
+		return NULL;
+	}
+	memcpy(flight->key, key, key_len);
+	flight->key_len = key_len;
+	flight->hash = hash;
+	flight->refs = 1;
+	pthread_cond_init(&flight->cond, NULL);
+	flight->next = *bucket;
+	*bucket = flight;
+	pthread_mutex_unlock(&group->lock);
+	return flight;
+}
+
+// The result is shared with current waiters only; it is not cached
+void
+singleflight_done(struct singleflight* group, struct flight* flight,
+				  int status, const void* value) {
+	if (!flight)
+		return;
+	pthread_mutex_lock(&group->lock);
+	struct flight** link = &group->buckets[flight->hash % SINGLEFLIGHT_BUCKETS];
+	while (*link && *link != flight)
+		link = &(*link)->next;
+	if (*link)
+		*link = flight->next;
+
+	flight->status = status;
+	if (flight->refs > 1 && value && group->copy_value)
+		flight->value = group->copy_value(value);
+	flight->done = 1;
+	pthread_cond_broadcast(&flight->cond);
+	flight_unref(group, flight);
+	pthread_mutex_unlock(&group->lock);
+}
+
+// *value stays valid until singleflight_release
+int
+singleflight_wait(struct singleflight* group, struct flight* flight,
+				  const void** value) {
+	pthread_mutex_lock(&group->lock);
+	while (!flight->done)
+		pthread_cond_wait(&flight->cond, &group->lock);
+	int status = flight->status;
+	*value = flight->value;
+	pthread_mutex_unlock(&group->lock);
+	return status;
+}
+
+void
+singleflight_release(struct singleflight* group, struct flight* flight) {
+	pthread_mutex_lock(&group->lock);
+	flight_unref(group, flight);
+	pthread_mutex_unlock(&group->lock);
+}
+
+// As singleflight_release, but hands the caller a value it owns: the last
+// waiter takes the shared copy itself, earlier ones get their own copy
+void*
+singleflight_take(struct singleflight* group, struct flight* flight) {
+	pthread_mutex_lock(&group->lock);
+	void* value = flight->value;
+	if (flight->refs == 1)
+		flight->value = NULL;
+	else if (value)
+		value = group->copy_value(value);
+	flight_unref(group, flight);
+	pthread_mutex_unlock(&group->lock);
+	return value;
+}
@@ -0,0 +1,512 @@
+#include "tcppool.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <time.h>
+
+#include <ldns/ldns.h>
+
+#define TCPPOOL_UPSTREAMS 16
+#define TCPPOOL_CONNS 4
+#define TCPPOOL_PIPELINE 64
+#define TCPPOOL_TIMEOUT 5000
+
+extern int verbosity;
+
+/*
+ * One outstanding query on a connection. The slot index is encoded in the
+ * low bits of the DNS message ID so out-of-order answers (RFC 7766 6.2.1.1)
+ * can be matched back to their waiter.
+ */
+struct tcp_slot {
+	int in_use;
+	int done;
+	int expired;
+	unsigned int epoch;
+	long long deadline;
+	uint16_t id;
+	uint8_t* query;
+	size_t query_len;
+	uint8_t* wire;
+	size_t wire_len;
+};
+
+struct tcp_conn {
+	int fd;
+	int reading;
+	unsigned int epoch;
+	uint16_t gen;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	struct tcp_slot slots[TCPPOOL_PIPELINE];
+};
+
+struct tcp_upstream {
+	struct sockaddr_storage addr;
+	size_t addrlen;
+	unsigned int next;
+	struct tcp_conn conns[TCPPOOL_CONNS];
+};
+
+static struct tcp_upstream upstreams[TCPPOOL_UPSTREAMS];
+static int upstream_count = 0;
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+
+int
+tcppool_prefer(ldns_rr_type rtype) {
+	// Answers for these are close to or above the EDNS buffer size once
+	// signed, so skip the UDP attempt and its truncate-retry round trip
+	return rtype == LDNS_RR_TYPE_DNSKEY || rtype == LDNS_RR_TYPE_ANY;
+}
+
+static struct tcp_conn*
+get_conn(struct sockaddr_storage* addr, size_t addrlen) {
+	struct tcp_conn* conn = NULL;
+	pthread_mutex_lock(&pool_lock);
+	struct tcp_upstream* up = NULL;
+	for (int i = 0; i < upstream_count; i++) {
+		if (upstreams[i].addrlen == addrlen &&
+			memcmp(&upstreams[i].addr, addr, addrlen) == 0) {
+			up = &upstreams[i];
+			break;
+		}
+	}
+	if (!up && upstream_count < TCPPOOL_UPSTREAMS) {
+		up = &upstreams[upstream_count++];
+		memcpy(&up->addr, addr, addrlen);
+		up->addrlen = addrlen;
+		up->next = 0;
+		for (int i = 0; i < TCPPOOL_CONNS; i++) {
+			up->conns[i].fd = -1;
+			up->conns[i].reading = 0;
+			up->conns[i].epoch = 0;
+			up->conns[i].gen = 0;
+			memset(up->conns[i].slots, 0, sizeof(up->conns[i].slots));
+			pthread_mutex_init(&up->conns[i].lock, NULL);
+			pthread_cond_init(&up->conns[i].cond, NULL);
+		}
+	}
+	if (up) {
+		conn = &up->conns[up->next % TCPPOOL_CONNS];
+		up->next++;
+	}
+	pthread_mutex_unlock(&pool_lock);
+	return conn;
+}
+
+static long long
+now_ms(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static int
+conn_open(struct tcp_conn* conn, struct sockaddr_storage* addr,
+		  size_t addrlen) {
+	int fd = socket(addr->ss_family, SOCK_STREAM, IPPROTO_TCP);
+	if (fd < 0)
+		return LDNS_STATUS_NETWORK_ERR;
+
+	struct timeval tv = { TCPPOOL_TIMEOUT / 1000, 0 };
+	setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+	int one = 1;
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+	if (connect(fd, (struct sockaddr*) addr, (socklen_t) addrlen) != 0) {
+		if (verbosity >= 3)
+			fprintf(stderr, "TCP connect to upstream failed: %s\n",
+					strerror(errno));
+		close(fd);
+		return LDNS_STATUS_NETWORK_ERR;
+	}
+	conn->fd = fd;
+	conn->epoch++;
+	return LDNS_STATUS_OK;
+}
+
+// Called with conn->lock held
+static void
+conn_fail(struct tcp_conn* conn, int fd, unsigned int epoch) {
+	if (conn->fd == fd) {
+		close(fd);
+		conn->fd = -1;
+	}
+	for (int i = 0; i < TCPPOOL_PIPELINE; i++) {
+		struct tcp_slot* slot = &conn->slots[i];
+		if (slot->in_use && !slot->done && slot->epoch == epoch) {
+			slot->done = 1;
+			slot->wire = NULL;
+		}
+	}
+	pthread_cond_broadcast(&conn->cond);
+}
+
+static int
+write_all(int fd, uint8_t* buf, size_t len) {
+	while (len > 0) {
+		ssize_t n = send(fd, buf, len, MSG_NOSIGNAL);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return -1;
+		buf += n;
+		len -= n;
+	}
+	return 0;
+}
+
+static int
+read_all(int fd, uint8_t* buf, size_t len) {
+	while (len > 0) {
+		struct pollfd pfd = { fd, POLLIN, 0 };
+		int ready = poll(&pfd, 1, TCPPOOL_TIMEOUT);
+		if (ready < 0 && errno == EINTR)
+			continue;
+		if (ready <= 0)
+			return -1;
+		ssize_t n = recv(fd, buf, len, 0);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return -1;
+		buf += n;
+		len -= n;
+	}
+	return 0;
+}
+
+/*
+ * Waits up to wait ms for the next message. Returns 1 if nothing arrived
+ * in that time and -1 if the stream broke; once a message has started, a
+ * stall loses the framing and counts as broken.
+ */
+static int
+read_msg(int fd, int wait, uint8_t** wire, size_t* wire_len) {
+	struct pollfd pfd = { fd, POLLIN, 0 };
+	int ready;
+	do {
+		ready = poll(&pfd, 1, wait);
+	} while (ready < 0 && errno == EINTR);
+	if (ready == 0)
+		return 1;
+	if (ready < 0)
+		return -1;
+
+	uint8_t lenbuf[2];
+	if (read_all(fd, lenbuf, 2) != 0)
+		return -1;
+	size_t len = (lenbuf[0] << 8) | lenbuf[1];
+	if (len < 12)
+		return -1;
+	*wire = malloc(len);
+	if (!*wire)
+		return -1;
+	if (read_all(fd, *wire, len) != 0) {
+		free(*wire);
+		return -1;
+	}
+	*wire_len = len;
+	return 0;
+}
+
+/*
+ * IDs are reused once a slot frees up, so a late answer to an expired query
+ * can carry the ID of the next one. Like ldns, also require the question
+ * to match; our queries hold a single uncompressed name.
+ */
+static int
+same_question(uint8_t* query, size_t query_len, uint8_t* reply,
+			  size_t reply_len) {
+	size_t end = 12;
+	while (end < query_len && query[end])
+		end += query[end] + 1;
+	end += 5;
+	if (end > query_len || end > reply_len || reply[4] != 0 || reply[5] != 1)
+		return 0;
+	for (size_t i = 12; i < end - 4; i++) {
+		if (tolower(query[i]) != tolower(reply[i]))
+			return 0;
+	}
+	return memcmp(query + end - 4, reply + end - 4, 4) == 0;
+}
+
+// Called with conn->lock held. Milliseconds until the first query expires.
+static int
+next_deadline(struct tcp_conn* conn, unsigned int epoch) {
+	long long first = 0;
+	for (int i = 0; i < TCPPOOL_PIPELINE; i++) {
+		struct tcp_slot* slot = &conn->slots[i];
+		if (slot->in_use && !slot->done && slot->epoch == epoch &&
+			(first == 0 || slot->deadline < first))
+			first = slot->deadline;
+	}
+	if (first == 0)
+		return TCPPOOL_TIMEOUT;
+	long long wait = first - now_ms();
+	return wait > 0 ? (int) wait : 0;
+}
+
+/*
+ * Called with conn->lock held. Fails only the queries past their own
+ * deadline; the rest keep waiting on the connection. Once nothing is left
+ * waiting the connection is dropped, as the upstream may have gone away.
+ */
+static void
+conn_expire(struct tcp_conn* conn, int fd, unsigned int epoch) {
+	long long now = now_ms();
+	int pending = 0;
+	for (int i = 0; i < TCPPOOL_PIPELINE; i++) {
+		struct tcp_slot* slot = &conn->slots[i];
+		if (!slot->in_use || slot->done || slot->epoch != epoch)
+			continue;
+		if (slot->deadline <= now) {
+			slot->done = 1;
+			slot->expired = 1;
+			slot->wire = NULL;
+		} else {
+			pending++;
+		}
+	}
+	if (pending == 0)
+		conn_fail(conn, fd, epoch);
+	else
+		pthread_cond_broadcast(&conn->cond);
+}
+
+// Called with conn->lock held. Returns with the slot answered or failed.
+static void
+wait_slot(struct tcp_conn* conn, struct tcp_slot* slot) {
+	while (!slot->done) {
+		if (conn->reading || conn->fd < 0) {
+			pthread_cond_wait(&conn->cond, &conn->lock);
+			continue;
+		}
+
+		// Become the reader for this connection until our answer arrives
+		int fd = conn->fd;
+		unsigned int epoch = conn->epoch;
+		int wait = next_deadline(conn, epoch);
+		conn->reading = 1;
+		pthread_mutex_unlock(&conn->lock);
+
+		uint8_t* wire;
+		size_t wire_len;
+		int failed = read_msg(fd, wait, &wire, &wire_len);
+
+		pthread_mutex_lock(&conn->lock);
+		conn->reading = 0;
+		if (failed > 0) {
+			conn_expire(conn, fd, epoch);
+			continue;
+		} else if (failed) {
+			conn_fail(conn, fd, epoch);
+			break;
+		}
+
+		uint16_t id = (wire[0] << 8) | wire[1];
+		struct tcp_slot* owner = &conn->slots[id % TCPPOOL_PIPELINE];
+		if (owner->in_use && !owner->done && owner->id == id &&
+			same_question(owner->query, owner->query_len, wire, wire_len)) {
+			owner->wire = wire;
+			owner->wire_len = wire_len;
+			owner->done = 1;
+		} else {
+			// Answer for a query whose waiter already gave up, or a stray
+			free(wire);
+		}
+		pthread_cond_broadcast(&conn->cond);
+	}
+}
+
+// A query that ran out of time sets *expired, so the caller does not retry
+static int
+conn_query(struct tcp_conn* conn, struct sockaddr_storage* addr,
+		   size_t addrlen, ldns_pkt* q, uint8_t** answer, size_t* answer_len,
+		   int* expired) {
+	int result = LDNS_STATUS_NETWORK_ERR;
+	*expired = 0;
+	pthread_mutex_lock(&conn->lock);
+
+	if (conn->fd < 0 && !conn->reading) {
+		if (conn_open(conn, addr, addrlen) != LDNS_STATUS_OK) {
+			pthread_mutex_unlock(&conn->lock);
+			return LDNS_STATUS_NETWORK_ERR;
+		}
+	}
+
+	// Claim a pipeline slot, waiting if the connection is saturated
+	struct tcp_slot* slot = NULL;
+	while (!slot) {
+		for (int i = 0; i < TCPPOOL_PIPELINE; i++) {
+			if (!conn->slots[i].in_use) {
+				slot = &conn->slots[i];
+				slot->id = (uint16_t) (conn->gen++ * TCPPOOL_PIPELINE + i);
+				break;
+			}
+		}
+		if (!slot)
+			pthread_cond_wait(&conn->cond, &conn->lock);
+	}
+	if (conn->fd < 0) {
+		pthread_mutex_unlock(&conn->lock);
+		return LDNS_STATUS_NETWORK_ERR;
+	}
+	slot->in_use = 1;
+	slot->done = 0;
+	slot->expired = 0;
+	slot->wire = NULL;
+	slot->epoch = conn->epoch;
+	slot->deadline = now_ms() + TCPPOOL_TIMEOUT;
+
+	ldns_pkt_set_id(q, slot->id);
+	uint8_t* wire;
+	size_t wire_len;
+	if (ldns_pkt2wire(&wire, q, &wire_len) != LDNS_STATUS_OK) {
+		slot->in_use = 0;
+		pthread_cond_broadcast(&conn->cond);
+		pthread_mutex_unlock(&conn->lock);
+		return LDNS_STATUS_ERR;
+	}
+
+	uint8_t* msg = malloc(wire_len + 2);
+	if (!msg) {
+		free(wire);
+		slot->in_use = 0;
+		pthread_cond_broadcast(&conn->cond);
+		pthread_mutex_unlock(&conn->lock);
+		return LDNS_STATUS_MEM_ERR;
+	}
+	msg[0] = (wire_len >> 8) & 0xff;
+	msg[1] = wire_len & 0xff;
+	memcpy(msg + 2, wire, wire_len);
+	free(wire);
+	// Kept until the slot is done, to check the answer's question
+	slot->query = msg + 2;
+	slot->query_len = wire_len;
+	if (write_all(conn->fd, msg, wire_len + 2) != 0) {
+		if (conn->reading) {
+			// Let the current reader notice the broken stream
+			shutdown(conn->fd, SHUT_RDWR);
+		} else {
+			conn_fail(conn, conn->fd, conn->epoch);
+		}
+	}
+
+	wait_slot(conn, slot);
+	free(msg);
+	slot->query = NULL;
+	if (slot->done && slot->wire) {
+		*answer = slot->wire;
+		*answer_len = slot->wire_len;
+		result = LDNS_STATUS_OK;
+	}
+	*expired = slot->expired;
+	slot->in_use = 0;
+	slot->done = 0;
+	slot->wire = NULL;
+	pthread_cond_broadcast(&conn->cond);
+	pthread_mutex_unlock(&conn->lock);
+	return result;
+}
+
+// Query one upstream over its pooled connections
+static int
+query_server(ldns_pkt** p, ldns_resolver* res, ldns_rdf* ns, ldns_pkt* q) {
+	size_t addrlen;
+	struct sockaddr_storage* addr =
+		ldns_rdf2native_sockaddr_storage(ns, ldns_resolver_port(res), &addrlen);
+	if (!addr)
+		return LDNS_STATUS_ERR;
+
+	struct tcp_conn* conn = get_conn(addr, addrlen);
+	if (!conn) {
+		free(addr);
+		return LDNS_STATUS_ERR;
+	}
+
+	struct timeval start, end;
+	gettimeofday(&start, NULL);
+	uint8_t* answer;
+	size_t answer_len;
+	int expired;
+	int result = conn_query(conn, addr, addrlen, q, &answer, &answer_len,
+							&expired);
+	if (result == LDNS_STATUS_NETWORK_ERR && !expired) {
+		// The connection may have been closed by the upstream while idle
+		result = conn_query(conn, addr, addrlen, q, &answer, &answer_len,
+							&expired);
+	}
+	gettimeofday(&end, NULL);
+	free(addr);
+	if (result != LDNS_STATUS_OK)
+		return result;
+
+	result = ldns_wire2pkt(p, answer, answer_len);
+	free(answer);
+	if (result != LDNS_STATUS_OK)
+		return result;
+
+	ldns_pkt_set_answerfrom(*p, ldns_rdf_clone(ns));
+	ldns_pkt_set_querytime(*p, (end.tv_sec - start.tv_sec) * 1000 +
+						   (end.tv_usec - start.tv_usec) / 1000);
+	ldns_pkt_set_size(*p, answer_len);
+	return LDNS_STATUS_OK;
+}
+
+// Upstreams are tried in the resolver's order, as ldns itself would
+int
+tcppool_query(ldns_pkt** p, ldns_resolver* res, ldns_rdf* domain,
+			  ldns_rr_type rtype) {
+	*p = NULL;
+	size_t count = ldns_resolver_nameserver_count(res);
+	if (count < 1)
+		return LDNS_STATUS_RES_NO_NS;
+
+	ldns_pkt* q;
+	int result = ldns_resolver_prepare_query_pkt(&q, res, domain, rtype,
+												 LDNS_RR_CLASS_IN, LDNS_RD);
+	if (result != LDNS_STATUS_OK)
+		return result;
+
+	ldns_rdf** ns = ldns_resolver_nameservers(res);
+	for (size_t i = 0; i < count; i++) {
+		result = query_server(p, res, ns[i], q);
+		if (result == LDNS_STATUS_OK)
+			break;
+		if (verbosity >= 3) {
+			fprintf(stderr, "Pooled TCP query to ");
+			ldns_rdf_print(stderr, ns[i]);
+			fprintf(stderr, " failed: %s\n", ldns_get_errorstr_by_id(result));
+		}
+	}
+	ldns_pkt_free(q);
+	return result;
+}
+
+void
+tcppool_free(void) {
+	pthread_mutex_lock(&pool_lock);
+	for (int i = 0; i < upstream_count; i++) {
+		for (int j = 0; j < TCPPOOL_CONNS; j++) {
+			struct tcp_conn* conn = &upstreams[i].conns[j];
+			if (conn->fd >= 0)
+				close(conn->fd);
+			conn->fd = -1;
+			pthread_mutex_destroy(&conn->lock);
+			pthread_cond_destroy(&conn->cond);
+		}
+	}
+	upstream_count = 0;
+	pthread_mutex_unlock(&pool_lock);
+}
@@ -0,0 +1,215 @@
+#include "upstream.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <time.h>
+#include <pthread.h>
+
+#include <ldns/ldns.h>
+
+#define UPSTREAM_MAX 32
+#define UPSTREAM_EXPLORE 20
+#define UPSTREAM_MAX_BACKOFF 60
+#define RTT_BUCKETS 2048
+#define RTT_REFRESH 64
+
+extern int verbosity;
+
+/*
+ * Smoothed RTT (RFC 6298 weights) and failure count for every upstream seen,
+ * shared by all resolvers in the process so each query goes to the server
+ * that has recently been fastest.
+ */
+struct upstream_stat {
+	ldns_rdf* addr;
+	int probed;
+	double srtt;
+	double rttvar;
+	int fails;
+	time_t down_until;
+};
+
+static struct upstream_stat stats[UPSTREAM_MAX];
+static int stat_count = 0;
+static unsigned int query_count = 0;
+static pthread_mutex_t stat_lock = PTHREAD_MUTEX_INITIALIZER;
+// Per thread, as rand() is not safe to call from several threads
+static __thread unsigned int explore_seed = 0;
+
+// Millisecond histogram of every RTT sample, for latency quantiles
+static unsigned long rtt_hist[RTT_BUCKETS];
+static unsigned long rtt_samples = 0;
+static int rtt_p95 = -1;
+
+// Called with stat_lock held
+static struct upstream_stat*
+find_stat(ldns_rdf* addr) {
+	for (int i = 0; i < stat_count; i++) {
+		if (ldns_rdf_compare(stats[i].addr, addr) == 0)
+			return &stats[i];
+	}
+	if (stat_count == UPSTREAM_MAX)
+		return NULL;
+
+	struct upstream_stat* stat = &stats[stat_count++];
+	stat->addr = ldns_rdf_clone(addr);
+	stat->probed = 0;
+	stat->srtt = 0;
+	stat->rttvar = 0;
+	stat->fails = 0;
+	stat->down_until = 0;
+	return stat;
+}
+
+static void
+swap_nameservers(ldns_resolver* res, size_t a, size_t b) {
+	ldns_rdf** ns = ldns_resolver_nameservers(res);
+	size_t* rtt = ldns_resolver_rtt(res);
+	ldns_rdf* tmp_ns = ns[a];
+	size_t tmp_rtt = rtt[a];
+	ns[a] = ns[b];
+	rtt[a] = rtt[b];
+	ns[b] = tmp_ns;
+	rtt[b] = tmp_rtt;
+}
+
+/*
+ * Move the preferred nameserver to the front of the resolver's list, so
+ * ldns sends to it first and only falls through to the others on failure.
+ * Unprobed servers are preferred until each has one RTT sample, and every
+ * UPSTREAM_EXPLORE queries a random healthy server is tried instead so
+ * recovering servers get a chance to be measured again. The list is
+ * reordered in place, so a resolver must not be shared between threads.
+ */
+ldns_rdf*
+upstream_select(ldns_resolver* res) {
+	size_t count = ldns_resolver_nameserver_count(res);
+	if (count == 0)
+		return NULL;
+	ldns_resolver_set_random(res, false);
+	if (count == 1)
+		return ldns_resolver_nameservers(res)[0];
+
+	ldns_rdf** ns = ldns_resolver_nameservers(res);
+	time_t now = time(NULL);
+	size_t best = 0;
+	double best_score = -1;
+	size_t soonest = 0;
+	time_t soonest_up = 0;
+	size_t healthy[UPSTREAM_MAX];
+	size_t healthy_count = 0;
+
+	if (explore_seed == 0)
+		explore_seed = (unsigned int) now ^
+			(unsigned int) (uintptr_t) &explore_seed;
+
+	pthread_mutex_lock(&stat_lock);
+	int explore = (++query_count % UPSTREAM_EXPLORE) == 0;
+	for (size_t i = 0; i < count; i++) {
+		struct upstream_stat* stat = find_stat(ns[i]);
+		if (!stat)
+			continue;
+		if (stat->down_until > now) {
+			if (soonest_up == 0 || stat->down_until < soonest_up) {
+				soonest = i;
+				soonest_up = stat->down_until;
+			}
+			continue;
+		}
+		if (healthy_count < UPSTREAM_MAX)
+			healthy[healthy_count++] = i;
+
+		double score = stat->probed ? stat->srtt + 4 * stat->rttvar : 0;
+		if (best_score < 0 || score < best_score) {
+			best = i;
+			best_score = score;
+		}
+	}
+	pthread_mutex_unlock(&stat_lock);
+
+	// Everything is backing off; retry whichever server recovers first
+	if (healthy_count == 0)
+		best = soonest;
+	else if (explore && healthy_count > 1)
+		best = healthy[rand_r(&explore_seed) % healthy_count];
+
+	// ldns skips servers it has marked unreachable; we decide that here
+	swap_nameservers(res, 0, best);
+	ldns_resolver_set_nameserver_rtt(res, 0, LDNS_RESOLV_RTT_MIN);
+	if (verbosity >= 3) {
+		printf("Selected upstream ");
+		ldns_rdf_print(stdout, ns[0]);
+		printf("%s\n", explore ? " (exploring)" : "");
+	}
+	return ns[0];
+}
+
+/*
+ * Record the outcome of a query sent to server. A reply from a different
+ * server means ldns fell through after the selected one failed.
+ */
+void
+upstream_report(ldns_rdf* server, ldns_pkt* pkt) {
+	if (!server)
+		return;
+	ldns_rdf* from = pkt ? ldns_pkt_answerfrom(pkt) : NULL;
+	time_t now = time(NULL);
+
+	pthread_mutex_lock(&stat_lock);
+	struct upstream_stat* stat = find_stat(server);
+	if (stat && (!from || ldns_rdf_compare(from, server) != 0)) {
+		stat->fails++;
+		int backoff = 1 << (stat->fails < 6 ? stat->fails : 6);
+		stat->down_until = now +
+			(backoff < UPSTREAM_MAX_BACKOFF ? backoff : UPSTREAM_MAX_BACKOFF);
+		stat = from ? find_stat(from) : NULL;
+	}
+	if (stat && from) {
+		double rtt = ldns_pkt_querytime(pkt);
+		rtt_hist[rtt < RTT_BUCKETS ? (int) rtt : RTT_BUCKETS - 1]++;
+		if (++rtt_samples % RTT_REFRESH == 0)
+			rtt_p95 = -1;
+		if (!stat->probed) {
+			stat->srtt = rtt;
+			stat->rttvar = rtt / 2;
+			stat->probed = 1;
+		} else {
+			double err = rtt - stat->srtt;
+			stat->srtt += err / 8;
+			stat->rttvar += ((err < 0 ? -err : err) - stat->rttvar) / 4;
+		}
+		stat->fails = 0;
+		stat->down_until = 0;
+	}
+	pthread_mutex_unlock(&stat_lock);
+}
+
+// Returns -1 until there are enough samples to be meaningful
+int
+upstream_rtt_p95(void) {
+	pthread_mutex_lock(&stat_lock);
+	if (rtt_p95 < 0 && rtt_samples >= RTT_REFRESH) {
+		unsigned long target = rtt_samples - rtt_samples / 20;
+		unsigned long seen = 0;
+		for (int i = 0; i < RTT_BUCKETS; i++) {
+			seen += rtt_hist[i];
+			if (seen >= target) {
+				rtt_p95 = i;
+				break;
+			}
+		}
+	}
+	int p95 = rtt_p95;
+	pthread_mutex_unlock(&stat_lock);
+	return p95;
+}
+
+void
+upstream_free(void) {
+	pthread_mutex_lock(&stat_lock);
+	for (int i = 0; i < stat_count; i++)
+		ldns_rdf_deep_free(stats[i].addr);
+	stat_count = 0;
+	pthread_mutex_unlock(&stat_lock);
+}
@@ -0,0 +1,134 @@
+#include "verify.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <openssl/evp.h>
+
+#include <ldns/ldns.h>
+
+#define ED25519_KEY_LEN 32
+#define ED25519_SIG_LEN 64
+
+extern int verbosity;
+
+// RRSIG timestamps use serial number arithmetic (RFC 4034 3.1.5)
+static ldns_status
+check_validity(ldns_rr* rrsig) {
+	int32_t now = (int32_t) time(NULL);
+	int32_t inception =
+		(int32_t) ldns_rdf2native_int32(ldns_rr_rrsig_inception(rrsig));
+	int32_t expiration =
+		(int32_t) ldns_rdf2native_int32(ldns_rr_rrsig_expiration(rrsig));
+
+	if (expiration - inception < 0)
+		return LDNS_STATUS_CRYPTO_EXPIRATION_BEFORE_INCEPTION;
+	if (now - inception < 0)
+		return LDNS_STATUS_CRYPTO_SIG_NOT_INCEPTED;
+	if (expiration - now < 0)
+		return LDNS_STATUS_CRYPTO_SIG_EXPIRED;
+	return LDNS_STATUS_OK;
+}
+
+// Signed data is the RRSIG rdata without the signature followed by the
+// RRset in canonical form (RFC 4034 3.1.8.1)
+static ldns_buffer*
+signed_data(ldns_rr_list* rrset, ldns_rr* rrsig) {
+	ldns_buffer* buf = ldns_buffer_new(LDNS_MAX_PACKETLEN);
+	if (!buf)
+		return NULL;
+	if (ldns_rrsig2buffer_wire(buf, rrsig) != LDNS_STATUS_OK) {
+		ldns_buffer_free(buf);
+		return NULL;
+	}
+
+	uint8_t labels = ldns_rdf2native_int8(ldns_rr_rrsig_labels(rrsig));
+	uint32_t ttl = ldns_rdf2native_int32(ldns_rr_rrsig_origttl(rrsig));
+	ldns_rr_list* canonical = ldns_rr_list_clone(rrset);
+	for (size_t i = 0; i < ldns_rr_list_rr_count(canonical); i++) {
+		ldns_rr* rr = ldns_rr_list_rr(canonical, i);
+		ldns_rr_set_ttl(rr, ttl);
+
+		// Answers synthesised from a wildcard are signed as the wildcard
+		ldns_rdf* owner = ldns_rr_owner(rr);
+		uint8_t owner_labels = ldns_dname_label_count(owner);
+		if (labels < owner_labels) {
+			ldns_rdf* star = ldns_dname_new_frm_str("*");
+			ldns_rdf* suffix = ldns_dname_clone_from(owner,
+													 owner_labels - labels);
+			ldns_rr_set_owner(rr, ldns_dname_cat_clone(star, suffix));
+			ldns_rdf_deep_free(star);
+			ldns_rdf_deep_free(suffix);
+			ldns_rdf_deep_free(owner);
+		}
+		ldns_rr2canonical(rr);
+	}
+	ldns_rr_list_sort(canonical);
+	ldns_status status = ldns_rr_list2buffer_wire(buf, canonical);
+	ldns_rr_list_deep_free(canonical);
+	if (status != LDNS_STATUS_OK) {
+		ldns_buffer_free(buf);
+		return NULL;
+	}
+	return buf;
+}
+
+/*
+ * Ed25519 is verified directly with OpenSSL: the raw DNSKEY field is the
+ * public key and the RRSIG field is the signature, so there is no key or
+ * signature conversion, and it works with ldns builds lacking Ed25519.
+ */
+static ldns_status
+verify_ed25519(ldns_rr_list* rrset, ldns_rr* rrsig, ldns_rr* key) {
+	ldns_rdf* key_rdf = ldns_rr_dnskey_key(key);
+	ldns_rdf* sig_rdf = ldns_rr_rrsig_sig(rrsig);
+	if (!key_rdf || !sig_rdf || ldns_rdf_size(key_rdf) != ED25519_KEY_LEN ||
+		ldns_rdf_size(sig_rdf) != ED25519_SIG_LEN)
+		return LDNS_STATUS_CRYPTO_BOGUS;
+
+	if (ldns_rdf2native_int16(ldns_rr_rrsig_keytag(rrsig)) !=
+		ldns_calc_keytag(key) ||
+		ldns_dname_compare(ldns_rr_rrsig_signame(rrsig),
+						   ldns_rr_owner(key)) != 0)
+		return LDNS_STATUS_CRYPTO_NO_MATCHING_KEYTAG_DNSKEY;
+
+	ldns_status result = check_validity(rrsig);
+	if (result != LDNS_STATUS_OK)
+		return result;
+
+	ldns_buffer* buf = signed_data(rrset, rrsig);
+	if (!buf)
+		return LDNS_STATUS_MEM_ERR;
+
+	EVP_PKEY* pkey = EVP_PKEY_new_raw_public_key(EVP_PKEY_ED25519, NULL,
+												 ldns_rdf_data(key_rdf),
+												 ED25519_KEY_LEN);
+	EVP_MD_CTX* ctx = EVP_MD_CTX_new();
+	result = LDNS_STATUS_CRYPTO_BOGUS;
+	if (pkey && ctx &&
+		EVP_DigestVerifyInit(ctx, NULL, NULL, NULL, pkey) == 1 &&
+		EVP_DigestVerify(ctx, ldns_rdf_data(sig_rdf), ED25519_SIG_LEN,
+						 ldns_buffer_begin(buf),
+						 ldns_buffer_position(buf)) == 1)
+		result = LDNS_STATUS_OK;
+
+	EVP_MD_CTX_free(ctx);
+	EVP_PKEY_free(pkey);
+	ldns_buffer_free(buf);
+	return result;
+}
+
+ldns_status
+verify_rrsig_key(ldns_rr_list* rrset, ldns_rr* rrsig, ldns_rr* key) {
+	if (rrset && rrsig && key &&
+		ldns_rr_get_type(key) == LDNS_RR_TYPE_DNSKEY) {
+		uint8_t sig_alg = ldns_rdf2native_int8(ldns_rr_rrsig_algorithm(rrsig));
+		uint8_t key_alg = ldns_rdf2native_int8(ldns_rr_dnskey_algorithm(key));
+		if (sig_alg == ALG_ED25519 && key_alg == ALG_ED25519)
+			return verify_ed25519(rrset, rrsig, key);
+	}
+
+	return ldns_verify_rrsig(rrset, rrsig, key);
+}
@@ -0,0 +1,689 @@
+#include "zone.h"
+#include "hash.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <libgen.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+#include <ldns/ldns.h>
+
+#define MAXBUF 1024
+#define ZONE_BUCKETS 1024
+#define ZONE_MAX_INCLUDE 8
+#define ZONE_POLL_MS 100
+#define ZONE_EDNS_SIZE 4096
+#define ZONE_BIND_TRIES 16
+
+extern int verbosity;
+
+/*
+ * Offline authoritative server for a set of zone files. Every zone is
+ * signed at load time with the private keys next to its DNSKEYs, DS
+ * records are derived for child zones whose KSK is known, and answers are
+ * built from memory over UDP and TCP on a loopback port, so the validation
+ * pipeline can run against the example zones without network access.
+ */
+struct zone_rrset {
+	ldns_rdf* owner;
+	ldns_rr_type type;
+	size_t depth;
+	ldns_rr_list* rrs;
+	ldns_rr_list* sigs;
+	struct zone_rrset* next;
+};
+
+struct zone_server {
+	ldns_zone** zones;
+	size_t zone_count;
+	struct zone_rrset* buckets[ZONE_BUCKETS];
+	ldns_rr_list* dnskeys;
+	int udp_fd;
+	int tcp_fd;
+	int port;
+	int started;
+	atomic_int running;
+	atomic_int connections;
+	pthread_t udp_thread;
+	pthread_t tcp_thread;
+};
+
+struct zone_connection {
+	struct zone_server* server;
+	int fd;
+};
+
+static FILE*
+open_include(char* path, char* zonedir, char* includedir) {
+	if (path[0] == '/')
+		return fopen(path, "r");
+
+	char fullpath[MAXBUF];
+	snprintf(fullpath, sizeof(fullpath), "%s/%s", zonedir, path);
+	FILE* file = fopen(fullpath, "r");
+	if (!file && includedir) {
+		snprintf(fullpath, sizeof(fullpath), "%s/%s", includedir, path);
+		file = fopen(fullpath, "r");
+	}
+	return file;
+}
+
+// ldns skips $INCLUDE, so the included text is copied in place
+static int
+expand_includes(FILE* out, FILE* in, char* zonedir, char* includedir,
+				int depth) {
+	char* line = NULL;
+	size_t size = 0;
+	int result = LDNS_STATUS_OK;
+	while (getline(&line, &size, in) != -1) {
+		if (strncmp(line, "$INCLUDE", 8) != 0) {
+			fputs(line, out);
+			continue;
+		}
+
+		char path[MAXBUF];
+		if (sscanf(line + 8, "%1023s", path) != 1) {
+			fprintf(stderr, "Missing file name for $INCLUDE\n");
+			result = LDNS_STATUS_SYNTAX_ERR;
+			break;
+		}
+		if (depth >= ZONE_MAX_INCLUDE) {
+			fprintf(stderr, "$INCLUDE nested too deep at %s\n", path);
+			result = LDNS_STATUS_SYNTAX_ERR;
+			break;
+		}
+		FILE* included = open_include(path, zonedir, includedir);
+		if (!included) {
+			// Generated files such as dssets are often not present
+			if (verbosity >= 1)
+				fprintf(stderr, "Skipping missing $INCLUDE %s\n", path);
+			continue;
+		}
+		result = expand_includes(out, included, zonedir, includedir,
+								 depth + 1);
+		fclose(included);
+		if (result != LDNS_STATUS_OK)
+			break;
+		fputc('\n', out);
+	}
+	free(line);
+	return result;
+}
+
+int
+zone_read(ldns_zone** zone, char* filename, char* includedir) {
+	FILE* in = fopen(filename, "r");
+	if (!in) {
+		fprintf(stderr, "Couldn't open zone file %s\n", filename);
+		return LDNS_STATUS_FILE_ERR;
+	}
+
+	char* text = NULL;
+	size_t len = 0;
+	FILE* out = open_memstream(&text, &len);
+	if (!out) {
+		fclose(in);
+		return LDNS_STATUS_MEM_ERR;
+	}
+	char* zonedir = strdup(filename);
+	int result = expand_includes(out, in, dirname(zonedir), includedir, 0);
+	fclose(out);
+	fclose(in);
+	free(zonedir);
+
+	if (result == LDNS_STATUS_OK && len == 0) {
+		fprintf(stderr, "Zone file %s is empty\n", filename);
+		result = LDNS_STATUS_ERR;
+	}
+	if (result == LDNS_STATUS_OK) {
+		FILE* expanded = fmemopen(text, len, "r");
+		int line_nr = 0;
+		result = ldns_zone_new_frm_fp_l(zone, expanded, NULL, 0,
+										LDNS_RR_CLASS_IN, &line_nr);
+		fclose(expanded);
+		if (result != LDNS_STATUS_OK)
+			fprintf(stderr, "Couldn't parse zone %s near line %d: %s\n",
+					filename, line_nr, ldns_get_errorstr_by_id(result));
+	}
+	free(text);
+	return result;
+}
+
+static ldns_rdf*
+zone_origin(ldns_zone* zone) {
+	return ldns_rr_owner(ldns_zone_soa(zone));
+}
+
+// Apex DNSKEYs, borrowed from the zone
+static ldns_rr_list*
+apex_dnskeys(ldns_zone* zone) {
+	ldns_rr_list* keys = ldns_rr_list_new();
+	ldns_rr_list* rrs = ldns_zone_rrs(zone);
+	for (size_t i = 0; i < ldns_rr_list_rr_count(rrs); i++) {
+		ldns_rr* rr = ldns_rr_list_rr(rrs, i);
+		if (ldns_rr_get_type(rr) == LDNS_RR_TYPE_DNSKEY &&
+			ldns_dname_compare(ldns_rr_owner(rr), zone_origin(zone)) == 0)
+			ldns_rr_list_push_rr(keys, rr);
+	}
+	return keys;
+}
+
+static int
+has_rrset(ldns_zone* zone, ldns_rdf* owner, ldns_rr_type type) {
+	ldns_rr_list* rrs = ldns_zone_rrs(zone);
+	for (size_t i = 0; i < ldns_rr_list_rr_count(rrs); i++) {
+		ldns_rr* rr = ldns_rr_list_rr(rrs, i);
+		if (ldns_rr_get_type(rr) == type &&
+			ldns_dname_compare(ldns_rr_owner(rr), owner) == 0)
+			return 1;
+	}
+	return 0;
+}
+
+// The closest enclosing zone that is being served
+static ldns_zone*
+parent_zone(struct zone_server* server, ldns_zone* child) {
+	ldns_zone* parent = NULL;
+	for (size_t i = 0; i < server->zone_count; i++) {
+		ldns_zone* zone = server->zones[i];
+		if (zone == child ||
+			!ldns_dname_is_subdomain(zone_origin(child), zone_origin(zone)))
+			continue;
+		if (!parent || ldns_dname_label_count(zone_origin(zone)) >
+			ldns_dname_label_count(zone_origin(parent)))
+			parent = zone;
+	}
+	return parent;
+}
+
+static void
+derive_ds(struct zone_server* server) {
+	for (size_t i = 0; i < server->zone_count; i++) {
+		ldns_zone* child = server->zones[i];
+		ldns_zone* parent = parent_zone(server, child);
+		if (!parent ||
+			has_rrset(parent, zone_origin(child), LDNS_RR_TYPE_DS))
+			continue;
+
+		ldns_rr_list* keys = apex_dnskeys(child);
+		for (size_t k = 0; k < ldns_rr_list_rr_count(keys); k++) {
+			ldns_rr* key = ldns_rr_list_rr(keys, k);
+			if (!(ldns_rdf2native_int16(ldns_rr_rdf(key, 0)) &
+				  LDNS_KEY_SEP_KEY))
+				continue;
+			ldns_rr* ds = ldns_key_rr2ds(key, LDNS_SHA256);
+			if (ds)
+				ldns_zone_push_rr(parent, ds);
+		}
+		ldns_rr_list_free(keys);
+	}
+}
+
+// Private keys are expected as K<zone>+<alg>+<keytag>.private in keydir
+static ldns_key_list*
+load_keys(ldns_zone* zone, char* keydir) {
+	ldns_key_list* keys = ldns_key_list_new();
+	ldns_rr_list* dnskeys = apex_dnskeys(zone);
+	char* owner = ldns_rdf2str(zone_origin(zone));
+	for (size_t i = 0; keys && owner && i < ldns_rr_list_rr_count(dnskeys);
+		 i++) {
+		ldns_rr* dnskey = ldns_rr_list_rr(dnskeys, i);
+		uint16_t keytag = ldns_calc_keytag(dnskey);
+		uint8_t algorithm = ldns_rdf2native_int8(ldns_rr_rdf(dnskey, 2));
+
+		char path[MAXBUF];
+		snprintf(path, sizeof(path), "%s/K%s+%03u+%05u.private", keydir,
+				 owner, algorithm, keytag);
+		FILE* file = fopen(path, "r");
+		if (!file) {
+			if (verbosity >= 1)
+				fprintf(stderr, "No private key %s\n", path);
+			continue;
+		}
+		ldns_key* key;
+		int result = ldns_key_new_frm_fp(&key, file);
+		fclose(file);
+		if (result != LDNS_STATUS_OK) {
+			fprintf(stderr, "Couldn't read private key %s: %s\n", path,
+					ldns_get_errorstr_by_id(result));
+			continue;
+		}
+		ldns_key_set_pubkey_owner(key, ldns_rdf_clone(zone_origin(zone)));
+		ldns_key_set_flags(key, ldns_rdf2native_int16(ldns_rr_rdf(dnskey, 0)));
+		ldns_key_set_keytag(key, keytag);
+		ldns_key_list_push_key(keys, key);
+	}
+	free(owner);
+	ldns_rr_list_free(dnskeys);
+	return keys;
+}
+
+static void
+sign_zones(struct zone_server* server, char* keydir) {
+	for (size_t i = 0; i < server->zone_count; i++) {
+		ldns_key_list* keys = load_keys(server->zones[i], keydir);
+		if (!keys)
+			continue;
+		if (ldns_key_list_key_count(keys) > 0) {
+			ldns_zone* signed_zone = ldns_zone_sign(server->zones[i], keys);
+			if (signed_zone) {
+				ldns_zone_deep_free(server->zones[i]);
+				server->zones[i] = signed_zone;
+			}
+		} else if (verbosity >= 0) {
+			char* owner = ldns_rdf2str(zone_origin(server->zones[i]));
+			fprintf(stderr, "Serving zone %s unsigned\n", owner);
+			free(owner);
+		}
+		ldns_key_list_free(keys);
+	}
+}
+
+static uint32_t
+owner_hash(ldns_rdf* owner) {
+	return hash_dname(ldns_rdf_data(owner), ldns_rdf_size(owner), HASH_SEED);
+}
+
+static void
+index_rr(struct zone_server* server, ldns_rr* rr, size_t depth) {
+	ldns_rr_type type = ldns_rr_get_type(rr);
+	int sig = type == LDNS_RR_TYPE_RRSIG;
+	if (sig)
+		type = ldns_rdf2rr_type(ldns_rr_rrsig_typecovered(rr));
+
+	// All types of one owner share a bucket so NXDOMAIN is one probe
+	struct zone_rrset** bucket =
+		&server->buckets[owner_hash(ldns_rr_owner(rr)) % ZONE_BUCKETS];
+	struct zone_rrset* set = *bucket;
+	for (; set; set = set->next) {
+		if (set->type == type && set->depth == depth &&
+			ldns_dname_compare(set->owner, ldns_rr_owner(rr)) == 0)
+			break;
+	}
+	if (!set) {
+		set = malloc(sizeof(struct zone_rrset));
+		if (!set)
+			return;
+		set->owner = ldns_rr_owner(rr);
+		set->type = type;
+		set->depth = depth;
+		set->rrs = ldns_rr_list_new();
+		set->sigs = ldns_rr_list_new();
+		set->next = *bucket;
+		*bucket = set;
+	}
+	ldns_rr_list_push_rr(sig ? set->sigs : set->rrs, rr);
+}
+
+static void
+index_zone(struct zone_server* server, ldns_zone* zone) {
+	size_t depth = ldns_dname_label_count(zone_origin(zone));
+	index_rr(server, ldns_zone_soa(zone), depth);
+	ldns_rr_list* rrs = ldns_zone_rrs(zone);
+	for (size_t i = 0; i < ldns_rr_list_rr_count(rrs); i++)
+		index_rr(server, ldns_rr_list_rr(rrs, i), depth);
+}
+
+// DS records are answered from the parent, everything else from the child
+static struct zone_rrset*
+rrset_find(struct zone_server* server, ldns_rdf* owner, ldns_rr_type type,
+		   int* owner_exists) {
+	struct zone_rrset* best = NULL;
+	*owner_exists = 0;
+	struct zone_rrset* set = server->buckets[owner_hash(owner) % ZONE_BUCKETS];
+	for (; set; set = set->next) {
+		if (ldns_dname_compare(set->owner, owner) != 0)
+			continue;
+		*owner_exists = 1;
+		if (set->type != type || ldns_rr_list_rr_count(set->rrs) == 0)
+			continue;
+		if (!best || (type == LDNS_RR_TYPE_DS ? set->depth < best->depth :
+					  set->depth > best->depth))
+			best = set;
+	}
+	return best;
+}
+
+static ldns_pkt*
+zone_answer(struct zone_server* server, ldns_pkt* q, int truncate) {
+	ldns_rr* question = ldns_rr_list_rr(ldns_pkt_question(q), 0);
+	ldns_pkt* answer = ldns_pkt_new();
+	if (!answer)
+		return NULL;
+	ldns_pkt_set_id(answer, ldns_pkt_id(q));
+	ldns_pkt_set_qr(answer, true);
+	ldns_pkt_set_aa(answer, true);
+	ldns_pkt_set_rd(answer, ldns_pkt_rd(q));
+	ldns_pkt_set_cd(answer, ldns_pkt_cd(q));
+	ldns_pkt_push_rr(answer, LDNS_SECTION_QUESTION, ldns_rr_clone(question));
+	if (ldns_pkt_edns(q)) {
+		ldns_pkt_set_edns_udp_size(answer, ZONE_EDNS_SIZE);
+		ldns_pkt_set_edns_do(answer, ldns_pkt_edns_do(q));
+	}
+	if (truncate) {
+		ldns_pkt_set_tc(answer, true);
+		return answer;
+	}
+
+	int owner_exists;
+	struct zone_rrset* set = rrset_find(server, ldns_rr_owner(question),
+										ldns_rr_get_type(question),
+										&owner_exists);
+	if (set) {
+		for (size_t i = 0; i < ldns_rr_list_rr_count(set->rrs); i++)
+			ldns_pkt_push_rr(answer, LDNS_SECTION_ANSWER,
+							 ldns_rr_clone(ldns_rr_list_rr(set->rrs, i)));
+		for (size_t i = 0; ldns_pkt_edns_do(q) &&
+				 i < ldns_rr_list_rr_count(set->sigs); i++)
+			ldns_pkt_push_rr(answer, LDNS_SECTION_ANSWER,
+							 ldns_rr_clone(ldns_rr_list_rr(set->sigs, i)));
+	} else if (!owner_exists) {
+		ldns_pkt_set_rcode(answer, LDNS_RCODE_NXDOMAIN);
+	}
+	return answer;
+}
+
+static int
+answer_wire(struct zone_server* server, uint8_t* query, size_t query_len,
+			int udp, uint8_t** wire, size_t* wire_len) {
+	ldns_pkt* q;
+	if (ldns_wire2pkt(&q, query, query_len) != LDNS_STATUS_OK)
+		return LDNS_STATUS_ERR;
+	if (ldns_pkt_qr(q) || ldns_rr_list_rr_count(ldns_pkt_question(q)) != 1) {
+		ldns_pkt_free(q);
+		return LDNS_STATUS_ERR;
+	}
+
+	ldns_pkt* answer = zone_answer(server, q, 0);
+	int result = answer ? ldns_pkt2wire(wire, answer, wire_len) :
+		LDNS_STATUS_MEM_ERR;
+	if (result == LDNS_STATUS_OK && udp) {
+		size_t limit = LDNS_MIN_BUFLEN;
+		if (ldns_pkt_edns(q) && ldns_pkt_edns_udp_size(q) > limit)
+			limit = ldns_pkt_edns_udp_size(q);
+		if (*wire_len > limit) {
+			// The client retries over TCP
+			free(*wire);
+			ldns_pkt_free(answer);
+			answer = zone_answer(server, q, 1);
+			result = answer ? ldns_pkt2wire(wire, answer, wire_len) :
+				LDNS_STATUS_MEM_ERR;
+		}
+	}
+	ldns_pkt_free(answer);
+	ldns_pkt_free(q);
+	return result;
+}
+
+static void*
+serve_udp(void* arg) {
+	struct zone_server* server = arg;
+	uint8_t buf[LDNS_MAX_PACKETLEN];
+	while (atomic_load(&server->running)) {
+		struct pollfd pfd = { server->udp_fd, POLLIN, 0 };
+		if (poll(&pfd, 1, ZONE_POLL_MS) <= 0)
+			continue;
+
+		struct sockaddr_storage from;
+		socklen_t fromlen = sizeof(from);
+		ssize_t n = recvfrom(server->udp_fd, buf, sizeof(buf), 0,
+							 (struct sockaddr*) &from, &fromlen);
+		if (n <= 0)
+			continue;
+		uint8_t* wire;
+		size_t wire_len;
+		if (answer_wire(server, buf, n, 1, &wire, &wire_len) ==
+			LDNS_STATUS_OK) {
+			sendto(server->udp_fd, wire, wire_len, 0, (struct sockaddr*) &from,
+				   fromlen);
+			free(wire);
+		}
+	}
+	return NULL;
+}
+
+// Polls so a stop request is noticed on idle connections
+static int
+read_full(struct zone_connection* conn, uint8_t* buf, size_t len) {
+	size_t have = 0;
+	while (have < len) {
+		if (!atomic_load(&conn->server->running))
+			return -1;
+		struct pollfd pfd = { conn->fd, POLLIN, 0 };
+		int ready = poll(&pfd, 1, ZONE_POLL_MS);
+		if (ready < 0)
+			return -1;
+		if (ready == 0)
+			continue;
+		ssize_t n = read(conn->fd, buf + have, len - have);
+		if (n <= 0)
+			return -1;
+		have += n;
+	}
+	return 0;
+}
+
+static int
+write_full(int fd, uint8_t* buf, size_t len) {
+	size_t done = 0;
+	while (done < len) {
+		ssize_t n = send(fd, buf + done, len - done, MSG_NOSIGNAL);
+		if (n <= 0)
+			return -1;
+		done += n;
+	}
+	return 0;
+}
+
+// Queries on a connection are answered in order; clients match on the ID
+static void*
+serve_connection(void* arg) {
+	struct zone_connection* conn = arg;
+	uint8_t buf[LDNS_MAX_PACKETLEN];
+	for (;;) {
+		uint8_t len_buf[2];
+		if (read_full(conn, len_buf, 2) != 0)
+			break;
+		size_t len = (len_buf[0] << 8) | len_buf[1];
+		if (len == 0 || read_full(conn, buf, len) != 0)
+			break;
+
+		uint8_t* wire;
+		size_t wire_len;
+		if (answer_wire(conn->server, buf, len, 0, &wire, &wire_len) !=
+			LDNS_STATUS_OK)
+			break;
+		len_buf[0] = (wire_len >> 8) & 0xff;
+		len_buf[1] = wire_len & 0xff;
+		int result = write_full(conn->fd, len_buf, 2) == 0 ?
+			write_full(conn->fd, wire, wire_len) : -1;
+		free(wire);
+		if (result != 0)
+			break;
+	}
+	close(conn->fd);
+	atomic_fetch_sub(&conn->server->connections, 1);
+	free(conn);
+	return NULL;
+}
+
+static void*
+serve_tcp(void* arg) {
+	struct zone_server* server = arg;
+	while (atomic_load(&server->running)) {
+		struct pollfd pfd = { server->tcp_fd, POLLIN, 0 };
+		if (poll(&pfd, 1, ZONE_POLL_MS) <= 0)
+			continue;
+
+		int fd = accept(server->tcp_fd, NULL, NULL);
+		if (fd < 0)
+			continue;
+		struct zone_connection* conn = malloc(sizeof(struct zone_connection));
+		if (!conn) {
+			close(fd);
+			continue;
+		}
+		conn->server = server;
+		conn->fd = fd;
+		atomic_fetch_add(&server->connections, 1);
+
+		pthread_t thread;
+		if (pthread_create(&thread, NULL, serve_connection, conn) != 0) {
+			atomic_fetch_sub(&server->connections, 1);
+			close(fd);
+			free(conn);
+			continue;
+		}
+		pthread_detach(thread);
+	}
+	return NULL;
+}
+
+// UDP and TCP on the same ephemeral loopback port
+static int
+bind_sockets(struct zone_server* server) {
+	for (int tries = 0; tries < ZONE_BIND_TRIES; tries++) {
+		struct sockaddr_in addr;
+		memset(&addr, 0, sizeof(addr));
+		addr.sin_family = AF_INET;
+		addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+		socklen_t addrlen = sizeof(addr);
+
+		int udp = socket(AF_INET, SOCK_DGRAM, 0);
+		if (udp < 0 || bind(udp, (struct sockaddr*) &addr, addrlen) != 0 ||
+			getsockname(udp, (struct sockaddr*) &addr, &addrlen) != 0) {
+			if (udp >= 0)
+				close(udp);
+			break;
+		}
+		int tcp = socket(AF_INET, SOCK_STREAM, 0);
+		if (tcp >= 0 && bind(tcp, (struct sockaddr*) &addr, addrlen) == 0 &&
+			listen(tcp, SOMAXCONN) == 0) {
+			server->udp_fd = udp;
+			server->tcp_fd = tcp;
+			server->port = ntohs(addr.sin_port);
+			return LDNS_STATUS_OK;
+		}
+
+		// Port already taken for TCP; try another pair
+		close(udp);
+		if (tcp >= 0)
+			close(tcp);
+	}
+	fprintf(stderr, "Couldn't bind a loopback port for the zone server\n");
+	return LDNS_STATUS_NETWORK_ERR;
+}
+
+static void
+zone_server_free(struct zone_server* server) {
+	for (int i = 0; i < ZONE_BUCKETS; i++) {
+		struct zone_rrset* set = server->buckets[i];
+		while (set) {
+			struct zone_rrset* next = set->next;
+			ldns_rr_list_free(set->rrs);
+			ldns_rr_list_free(set->sigs);
+			free(set);
+			set = next;
+		}
+	}
+	for (size_t i = 0; i < server->zone_count; i++)
+		ldns_zone_deep_free(server->zones[i]);
+	free(server->zones);
+	if (server->dnskeys)
+		ldns_rr_list_free(server->dnskeys);
+	if (server->udp_fd >= 0)
+		close(server->udp_fd);
+	if (server->tcp_fd >= 0)
+		close(server->tcp_fd);
+	free(server);
+}
+
+struct zone_server*
+zone_serve_start(char** files, size_t count, char* keydir) {
+	struct zone_server* server = calloc(1, sizeof(struct zone_server));
+	if (!server)
+		return NULL;
+	server->udp_fd = -1;
+	server->tcp_fd = -1;
+	server->zones = calloc(count, sizeof(ldns_zone*));
+	if (!server->zones) {
+		zone_server_free(server);
+		return NULL;
+	}
+
+	for (size_t i = 0; i < count; i++) {
+		ldns_zone* zone;
+		if (zone_read(&zone, files[i], keydir) != LDNS_STATUS_OK) {
+			zone_server_free(server);
+			return NULL;
+		}
+		server->zones[server->zone_count++] = zone;
+		if (!ldns_zone_soa(zone)) {
+			fprintf(stderr, "Zone file %s has no SOA record\n", files[i]);
+			zone_server_free(server);
+			return NULL;
+		}
+	}
+	derive_ds(server);
+	sign_zones(server, keydir);
+
+	server->dnskeys = ldns_rr_list_new();
+	for (size_t i = 0; i < server->zone_count; i++) {
+		index_zone(server, server->zones[i]);
+		ldns_rr_list* keys = apex_dnskeys(server->zones[i]);
+		ldns_rr_list_push_rr_list(server->dnskeys, keys);
+		ldns_rr_list_free(keys);
+	}
+
+	if (bind_sockets(server) != LDNS_STATUS_OK) {
+		zone_server_free(server);
+		return NULL;
+	}
+	atomic_store(&server->running, 1);
+	if (pthread_create(&server->udp_thread, NULL, serve_udp, server) != 0) {
+		zone_server_free(server);
+		return NULL;
+	}
+	if (pthread_create(&server->tcp_thread, NULL, serve_tcp, server) != 0) {
+		atomic_store(&server->running, 0);
+		pthread_join(server->udp_thread, NULL);
+		zone_server_free(server);
+		return NULL;
+	}
+	server->started = 1;
+	if (verbosity >= 1)
+		fprintf(stderr, "Serving %zu zones on 127.0.0.1 port %d\n",
+				server->zone_count, server->port);
+	return server;
+}
+
+int
+zone_serve_port(struct zone_server* server) {
+	return server->port;
+}
+
+ldns_rr_list*
+zone_serve_dnskeys(struct zone_server* server) {
+	return server->dnskeys;
+}
+
+void
+zone_serve_stop(struct zone_server* server) {
+	if (!server)
+		return;
+	if (server->started) {
+		atomic_store(&server->running, 0);
+		pthread_join(server->udp_thread, NULL);
+		pthread_join(server->tcp_thread, NULL);
+		while (atomic_load(&server->connections) > 0)
+			usleep(1000);
+	}
+	zone_server_free(server);
+}
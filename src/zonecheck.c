@@ -0,0 +1,385 @@
+#include "resolve.h"
+#include "arena.h"
+#include "certstore.h"
+#include "hash.h"
+#include "helper.h"
+#include "pktindex.h"
+#include "verify.h"
+#include "zone.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <libgen.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <ldns/ldns.h>
+
+#define MAXBUF 1024
+#define ZONECHECK_CHUNK 64
+
+int verbosity = 0;
+
+/*
+ * Verifies every RRSIG in a signed zone file without any DNS traffic. The
+ * zone is grouped into RRsets in one pass, the keys of each signer are
+ * fetched once up front, and the RRsets are then verified in parallel.
+ */
+struct signer {
+	ldns_rdf* name;
+	ldns_rr_list* keys;
+	uint16_t* keytags;
+	int owns_keys;
+	struct signer* next;
+};
+
+struct zonecheck {
+	struct pktindex index;
+	struct signer** signers;
+	size_t signer_buckets;
+	ldns_status* results;
+	atomic_size_t next;
+	atomic_size_t signatures;
+	atomic_size_t failed;
+};
+
+static int
+usage(FILE *fp, char *prog) {
+	fprintf(fp, "%s [options] <zonefile>\n", prog);
+	fprintf(fp, "  verify every RRSIG in a signed zone file\n");
+	fprintf(fp, "OPTIONS:\n");
+	fprintf(fp, "-dnskey\t\tVerify against the DNSKEYs in the zone instead of the database\n");
+	fprintf(fp, "-i <directory>\t\tLook for $INCLUDE files here as well (default <zone directory>/keys)\n");
+	fprintf(fp, "-preload\t\tLoad all database keys at startup\n");
+	fprintf(fp, "-threads <count>\t\tVerification threads (default one per core)\n");
+	fprintf(fp, "-v <verbosity>\t\tVerbosity level [1-5]\n");
+	return 0;
+}
+
+static int
+group_zone(struct zonecheck* check, ldns_zone* zone) {
+	ldns_rr_list* rrs = ldns_zone_rrs(zone);
+	int result = pktindex_init(&check->index, ldns_rr_list_rr_count(rrs) + 1);
+	if (result == LDNS_STATUS_OK && ldns_zone_soa(zone))
+		result = pktindex_add(&check->index, ldns_zone_soa(zone),
+							  LDNS_SECTION_ANY);
+	for (size_t i = 0; result == LDNS_STATUS_OK &&
+			 i < ldns_rr_list_rr_count(rrs); i++)
+		result = pktindex_add(&check->index, ldns_rr_list_rr(rrs, i),
+							  LDNS_SECTION_ANY);
+	return result;
+}
+
+static struct signer*
+signer_find(struct zonecheck* check, ldns_rdf* name) {
+	size_t b = hash_dname(ldns_rdf_data(name), ldns_rdf_size(name), HASH_SEED) %
+		check->signer_buckets;
+	struct signer* signer = check->signers[b];
+	for (; signer; signer = signer->next) {
+		if (ldns_dname_compare(signer->name, name) == 0)
+			return signer;
+	}
+	return NULL;
+}
+
+// ZSK and KSK registered in the database (or the certstore) for name
+static ldns_rr_list*
+database_keys(ldns_rdf* name) {
+	ldns_rr_list* keys = ldns_rr_list_new();
+	char* domain = ldns_rdf2str(name);
+	for (int ksk = 0; domain && ksk <= 1; ksk++) {
+		char* keystr;
+		uint8_t algorithm;
+		if (get_key(&keystr, &algorithm, domain, ksk) != LDNS_STATUS_OK)
+			continue;
+		ldns_rr* key;
+		if (trustedkey_fromkey(&key, keystr, domain, ksk, algorithm) ==
+			LDNS_STATUS_OK)
+			ldns_rr_list_push_rr(keys, key);
+	}
+	free(domain);
+	arena_reset(arena_thread());
+	return keys;
+}
+
+// Each signer's keys are fetched once, before verification starts
+static int
+fetch_signers(struct zonecheck* check, int zone_keys) {
+	check->signer_buckets = 256;
+	check->signers = calloc(check->signer_buckets, sizeof(struct signer*));
+	if (!check->signers)
+		return LDNS_STATUS_MEM_ERR;
+
+	for (size_t i = 0; i < check->index.count; i++) {
+		ldns_rr_list* sigs = check->index.groups[i].sigs;
+		for (size_t s = 0; s < ldns_rr_list_rr_count(sigs); s++) {
+			ldns_rdf* name = ldns_rr_rrsig_signame(ldns_rr_list_rr(sigs, s));
+			if (!name || signer_find(check, name))
+				continue;
+
+			struct signer* signer = calloc(1, sizeof(struct signer));
+			if (!signer)
+				return LDNS_STATUS_MEM_ERR;
+			// Linked first so that main frees it even if the rest fails
+			size_t b = hash_dname(ldns_rdf_data(name), ldns_rdf_size(name),
+								  HASH_SEED) % check->signer_buckets;
+			signer->next = check->signers[b];
+			check->signers[b] = signer;
+			signer->name = name;
+			if (zone_keys) {
+				struct rrgroup* dnskeys = pktindex_find(&check->index,
+					LDNS_SECTION_ANY, name, LDNS_RR_TYPE_DNSKEY);
+				signer->keys = dnskeys ? dnskeys->rrs : ldns_rr_list_new();
+				signer->owns_keys = dnskeys == NULL;
+			} else {
+				signer->keys = database_keys(name);
+				signer->owns_keys = 1;
+			}
+			if (!signer->keys)
+				return LDNS_STATUS_MEM_ERR;
+			size_t key_count = ldns_rr_list_rr_count(signer->keys);
+			signer->keytags = calloc(key_count + 1, sizeof(uint16_t));
+			if (!signer->keytags)
+				return LDNS_STATUS_MEM_ERR;
+			for (size_t k = 0; k < key_count; k++)
+				signer->keytags[k] =
+					ldns_calc_keytag(ldns_rr_list_rr(signer->keys, k));
+			if (key_count == 0 && verbosity >= 0) {
+				char* domain = ldns_rdf2str(name);
+				printf("No keys available for %s\n", domain);
+				free(domain);
+			}
+		}
+	}
+	return LDNS_STATUS_OK;
+}
+
+// Keys with the RRSIG's key tag first, then the rest as verify_rr would
+static ldns_status
+verify_signature(struct zonecheck* check, ldns_rr_list* rrset, ldns_rr* rrsig) {
+	struct signer* signer = signer_find(check, ldns_rr_rrsig_signame(rrsig));
+	if (!signer || ldns_rr_list_rr_count(signer->keys) == 0)
+		return LDNS_STATUS_CRYPTO_NO_TRUSTED_DNSKEY;
+	if (!signer->keytags)
+		return LDNS_STATUS_MEM_ERR;
+
+	uint16_t keytag = ldns_rdf2native_int16(ldns_rr_rrsig_keytag(rrsig));
+	ldns_status result = LDNS_STATUS_CRYPTO_NO_MATCHING_KEYTAG_DNSKEY;
+	for (int pass = 0; pass <= 1; pass++) {
+		for (size_t k = 0; k < ldns_rr_list_rr_count(signer->keys); k++) {
+			if ((signer->keytags[k] == keytag) != (pass == 0))
+				continue;
+			result = verify_rrsig_key(rrset, rrsig,
+									  ldns_rr_list_rr(signer->keys, k));
+			if (result == LDNS_STATUS_OK)
+				return result;
+		}
+	}
+	return result;
+}
+
+static void*
+worker(void* arg) {
+	struct zonecheck* check = arg;
+	for (;;) {
+		size_t start = atomic_fetch_add(&check->next, ZONECHECK_CHUNK);
+		if (start >= check->index.count)
+			break;
+		size_t end = start + ZONECHECK_CHUNK;
+		if (end > check->index.count)
+			end = check->index.count;
+
+		size_t signatures = 0;
+		size_t failed = 0;
+		for (size_t i = start; i < end; i++) {
+			struct rrgroup* group = &check->index.groups[i];
+			check->results[i] = LDNS_STATUS_OK;
+			for (size_t s = 0; s < ldns_rr_list_rr_count(group->sigs); s++) {
+				ldns_status result = verify_signature(check, group->rrs,
+													  ldns_rr_list_rr(group->sigs, s));
+				signatures++;
+				if (result != LDNS_STATUS_OK) {
+					failed++;
+					check->results[i] = result;
+				}
+			}
+		}
+		atomic_fetch_add(&check->signatures, signatures);
+		atomic_fetch_add(&check->failed, failed);
+	}
+	arena_thread_free();
+	return NULL;
+}
+
+static double
+now_seconds(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void
+report(struct zonecheck* check, double elapsed) {
+	size_t unsigned_sets = 0;
+	for (size_t i = 0; i < check->index.count; i++) {
+		struct rrgroup* group = &check->index.groups[i];
+		if (ldns_rr_list_rr_count(group->sigs) == 0) {
+			// Delegations and glue are legitimately unsigned
+			unsigned_sets++;
+			if (verbosity >= 2) {
+				char* type = ldns_rr_type2str(group->type);
+				printf("Unsigned: ");
+				ldns_rdf_print(stdout, group->owner);
+				printf(" %s\n", type);
+				free(type);
+			}
+		} else if (ldns_rr_list_rr_count(group->rrs) == 0) {
+			if (verbosity >= 0) {
+				printf("Failed: ");
+				ldns_rdf_print(stdout, group->owner);
+				printf(" RRSIG without records\n");
+			}
+		} else if (check->results[i] != LDNS_STATUS_OK && verbosity >= 0) {
+			printf("Failed: ");
+			ldns_rdf_print(stdout, group->owner);
+			char* type = ldns_rr_type2str(group->type);
+			printf(" %s: %s\n", type,
+				   ldns_get_errorstr_by_id(check->results[i]));
+			free(type);
+		}
+	}
+
+	size_t signatures = atomic_load(&check->signatures);
+	printf("\nRRsets:      %zu (%zu unsigned)\n", check->index.count,
+		   unsigned_sets);
+	printf("Signatures:  %zu (%zu failed)\n", signatures,
+		   atomic_load(&check->failed));
+	printf("Time taken:  %.3f s\n", elapsed);
+	if (elapsed > 0)
+		printf("Throughput:  %.0f signatures/s\n", signatures / elapsed);
+}
+
+int
+main(int argc, char *argv[]) {
+	int result;
+	char *arg_end_ptr = NULL;
+	char* zonefile = NULL;
+	char* includedir = NULL;
+	int zone_keys = 0;
+	int preload = 0;
+	long threads = sysconf(_SC_NPROCESSORS_ONLN);
+	ldns_zone* zone = NULL;
+
+	struct zonecheck check;
+	memset(&check, 0, sizeof(check));
+
+	if (argc < 2) {
+		usage(stdout, argv[0]);
+		exit(EXIT_FAILURE);
+	}
+	for (int i = 1; i < argc; i++) {
+		if (strcmp("-dnskey", argv[i]) == 0) {
+			zone_keys = 1;
+		} else if (strcmp("-preload", argv[i]) == 0) {
+			preload = 1;
+		} else if (strcmp("-i", argv[i]) == 0 && i + 1 < argc) {
+			includedir = argv[++i];
+		} else if (strcmp("-threads", argv[i]) == 0 && i + 1 < argc) {
+			threads = strtol(argv[i+1], &arg_end_ptr, 10);
+			if (*arg_end_ptr != '\0' || threads <= 0) {
+				printf("Bad argument for -threads: %s\n", argv[i+1]);
+				exit(1);
+			}
+			i++;
+		} else if (strncmp(argv[i], "-v", 3) == 0 && i + 1 < argc) {
+			verbosity = strtol(argv[i+1], &arg_end_ptr, 10);
+			if (*arg_end_ptr != '\0') {
+				printf("Bad argument for -v: %s\n", argv[i+1]);
+				exit(1);
+			}
+			i++;
+		} else if (argv[i][0] != '-' && !zonefile) {
+			zonefile = argv[i];
+		} else {
+			usage(stdout, argv[0]);
+			exit(1);
+		}
+	}
+	if (!zonefile) {
+		printf("No zone file given\n");
+		exit(1);
+	}
+	if (threads <= 0)
+		threads = 1;
+
+	char defaultdir[MAXBUF];
+	if (!includedir) {
+		char* zonedir = strdup(zonefile);
+		snprintf(defaultdir, sizeof(defaultdir), "%s/keys", dirname(zonedir));
+		free(zonedir);
+		includedir = defaultdir;
+	}
+
+	double start = now_seconds();
+	result = zone_read(&zone, zonefile, includedir);
+	if (result != LDNS_STATUS_OK)
+		goto exit;
+	result = group_zone(&check, zone);
+	if (result != LDNS_STATUS_OK)
+		goto exit;
+	if (verbosity >= 1)
+		printf("Read %zu RRsets in %.3f s\n", check.index.count,
+			   now_seconds() - start);
+
+	if (preload && !zone_keys) {
+		result = certstore_start(CONFIG_FILE);
+		if (result != LDNS_STATUS_OK)
+			goto exit;
+	}
+	result = fetch_signers(&check, zone_keys);
+	if (result != LDNS_STATUS_OK)
+		goto exit;
+
+	check.results = calloc(check.index.count + 1, sizeof(ldns_status));
+	pthread_t* workers = calloc(threads, sizeof(pthread_t));
+	if (!check.results || !workers) {
+		free(workers);
+		result = LDNS_STATUS_MEM_ERR;
+		goto exit;
+	}
+	double verify_start = now_seconds();
+	for (long i = 0; i < threads; i++)
+		pthread_create(&workers[i], NULL, worker, &check);
+	for (long i = 0; i < threads; i++)
+		pthread_join(workers[i], NULL);
+	free(workers);
+	report(&check, now_seconds() - verify_start);
+	if (atomic_load(&check.failed) > 0)
+		result = LDNS_STATUS_CRYPTO_BOGUS;
+
+ exit:
+	for (size_t b = 0; check.signers && b < check.signer_buckets; b++) {
+		struct signer* signer = check.signers[b];
+		while (signer) {
+			struct signer* next = signer->next;
+			if (signer->owns_keys)
+				ldns_rr_list_deep_free(signer->keys);
+			free(signer->keytags);
+			free(signer);
+			signer = next;
+		}
+	}
+	free(check.signers);
+	pktindex_free(&check.index);
+	free(check.results);
+	if (zone)
+		ldns_zone_deep_free(zone);
+	certstore_stop();
+	close_mysql();
+	arena_thread_free();
+
+	return result;
+}
@@ -5,11 +5,23 @@ if [ -z "$1" ]; then
 	exit 1;
 fi
 
+# ECDSAP256SHA256, ECDSAP384SHA384, ED25519 or RSASHA256
+ALG=${3:-ECDSAP256SHA256}
+case "$ALG" in
+	ECDSAP256SHA256) BITS=256 ;;
+	ECDSAP384SHA384) BITS=384 ;;
+	ED25519) BITS=256 ;;
+	RSASHA256) BITS=2048 ;;
+	*)
+		echo "Algorithm must be one of ECDSAP256SHA256, ECDSAP384SHA384, ED25519 or RSASHA256"
+		exit 1;
+esac
+
 if [ -z "$2" ] || [ "$2" == "ZSK" ]; then
-	dnssec-keygen -a ECDSAP256SHA256 -b 256 -n ZONE $1
+	dnssec-keygen -a $ALG -b $BITS -n ZONE $1
 else
 	if [ "$2" == "KSK" ]; then
-		dnssec-keygen -f KSK -a ECDSAP256SHA256 -b 256 -n ZONE $1
+		dnssec-keygen -f KSK -a $ALG -b $BITS -n ZONE $1
 	else
 		echo "Second argument 'KSK' if you wish to generate a key signing key"
 		exit 1;
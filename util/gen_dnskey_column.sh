@@ -0,0 +1,66 @@
+#!/bin/bash
+
+# Print the DNSKEY algorithm octet followed by the public key field, in hex,
+# for the PEM certificate on stdin
+dnskey_hex() {
+	local pub=$(openssl x509 -pubkey -noout)
+	local text=$(echo "$pub" | openssl pkey -pubin -text -noout)
+	local der=$(echo "$pub" | openssl pkey -pubin -outform DER | xxd -p | tr -d '\n')
+
+	# EC and EdDSA keys end the SubjectPublicKeyInfo with the raw key; for
+	# ECDSA that is the uncompressed point without its leading 0x04
+	if echo "$text" | grep -q "prime256v1"; then
+		echo "0d${der: -128}"
+	elif echo "$text" | grep -q "secp384r1"; then
+		echo "0e${der: -192}"
+	elif echo "$text" | grep -qi "ED25519"; then
+		echo "0f${der: -64}"
+	elif echo "$text" | grep -qi "ED448"; then
+		echo "10${der: -114}"
+	elif echo "$text" | grep -q "Modulus"; then
+		# RFC 3110: exponent length, exponent, modulus
+		local n=$(echo "$pub" | openssl rsa -pubin -modulus -noout | cut -d= -f2)
+		local e=$(printf "%x" $(echo "$text" | grep Exponent | awk '{print $2}'))
+		[ $(( ${#e} % 2 )) -eq 1 ] && e="0$e"
+		local elen=$(( ${#e} / 2 ))
+		if [ $elen -gt 255 ]; then
+			echo "08$(printf "00%04x" $elen)$e$n"
+		else
+			echo "08$(printf "%02x" $elen)$e$n"
+		fi
+	fi
+}
+
+# Convert a single certificate read from stdin
+if [ "$1" == "-" ]; then
+	dnskey_hex
+	exit 0;
+fi
+
+CONFIG=${1:-config.conf}
+
+if [ ! -f "$CONFIG" ]; then
+	echo "Need config file with username, password and dbname"
+	exit 1;
+fi
+
+USERNAME=$(grep '^username=' $CONFIG | cut -d= -f2-)
+PASSWORD=$(grep '^password=' $CONFIG | cut -d= -f2-)
+DBNAME=$(grep '^dbname=' $CONFIG | cut -d= -f2-)
+
+sql() {
+	mysql -N -B -u "$USERNAME" -p"$PASSWORD" "$DBNAME" -e "$1"
+}
+
+# The domain is passed around hex encoded, so no quoting can break the SQL
+sql "SELECT HEX(domain), ksk, HEX(cert) FROM certificates WHERE cert IS NOT NULL" |
+	while read domain_hex ksk cert; do
+		domain=$(echo "$domain_hex" | xxd -r -p)
+		key=$(echo "$cert" | xxd -r -p | dnskey_hex)
+		if [ -z "$key" ] || ! [[ "$domain_hex" =~ ^[0-9A-F]+$ && "$ksk" =~ ^[01]$ ]]; then
+			echo "Could not read certificate for $domain"
+			continue
+		fi
+		sql "UPDATE certificates SET dnskey=UNHEX('$key') WHERE domain=UNHEX('$domain_hex') AND ksk=$ksk"
+		echo "Updated $domain $([ "$ksk" == "1" ] && echo KSK || echo ZSK)"
+	done
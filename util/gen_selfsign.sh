@@ -3,15 +3,32 @@
 if [ -z "$1" ]; then
 	echo "Need to supply cert name"
 else
-	if [ -z "$2" ]; then
-		echo "Generating ECDSAP256SHA256 key"
+	if [ -z "$2" ] || [ ! -f "$2" ]; then
+		# Second argument is an algorithm when it is not a key file
+		case "${2:-ECDSAP256SHA256}" in
+			ECDSAP256SHA256) CURVE="prime256v1" ;;
+			ECDSAP384SHA384) CURVE="secp384r1" ;;
+			ED25519) NEWKEY="ed25519" ;;
+			RSASHA256) NEWKEY="rsa:2048" ;;
+			*)
+				echo "Algorithm must be one of ECDSAP256SHA256, ECDSAP384SHA384, ED25519 or RSASHA256"
+				exit 1;
+		esac
+		if [ -n "$CURVE" ]; then
+			# openssl req takes EC parameters from a file
+			PARAMS=$(mktemp) || exit 1
+			trap 'rm -f "$PARAMS"' EXIT
+			openssl ecparam -name "$CURVE" -out "$PARAMS" || exit 1
+			NEWKEY="ec:$PARAMS"
+		fi
+		echo "Generating ${2:-ECDSAP256SHA256} key"
 		openssl req -new -x509 -nodes -days 365 \
-				-newkey ec:<(openssl ecparam -name prime256v1) \
-				-keyout $1.key \
-				-out $1.crt
+				-newkey "$NEWKEY" \
+				-keyout "$1.key" \
+				-out "$1.crt"
 	else
 		openssl req -new -x509 -days 365 \
-				-key $2 \
-				-out $1.crt
+				-key "$2" \
+				-out "$1.crt"
 	fi
 fi
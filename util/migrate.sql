@@ -0,0 +1,30 @@
+-- Index lookups by (domain, ksk) and add the precomputed DNSKEY public key
+-- column filled in by ./util/gen_dnskey_column.sh
+ALTER TABLE certificates
+	ADD COLUMN dnskey VARBINARY(1024) NULL,
+	ADD INDEX domain_ksk (domain, ksk);
+
+-- Change feed for -preload: updated_at marks added and changed rows, and
+-- certificate_deletions records keys that were removed or renamed, so the
+-- refresh only reads what changed since its last poll
+ALTER TABLE certificates
+	ADD COLUMN updated_at TIMESTAMP(6) NOT NULL
+		DEFAULT CURRENT_TIMESTAMP(6) ON UPDATE CURRENT_TIMESTAMP(6),
+	ADD INDEX updated_at (updated_at);
+
+CREATE TABLE certificate_deletions (
+	domain VARCHAR(191) NULL,
+	ksk TINYINT(1) NOT NULL,
+	deleted_at TIMESTAMP(6) NOT NULL DEFAULT CURRENT_TIMESTAMP(6),
+	INDEX deleted_at (deleted_at)
+);
+
+CREATE TRIGGER certificates_deleted AFTER DELETE ON certificates
+	FOR EACH ROW
+	INSERT INTO certificate_deletions (domain, ksk) VALUES (OLD.domain, OLD.ksk);
+
+CREATE TRIGGER certificates_renamed AFTER UPDATE ON certificates
+	FOR EACH ROW
+	INSERT INTO certificate_deletions (domain, ksk)
+	SELECT OLD.domain, OLD.ksk FROM DUAL
+	WHERE NOT (OLD.domain <=> NEW.domain) OR OLD.ksk <> NEW.ksk;